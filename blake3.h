@@ -75,6 +75,29 @@ BLAKE3_API void blake3_hasher_finalize_seek(const blake3_hasher *self, uint64_t
                                             uint8_t *out, size_t out_len);
 BLAKE3_API void blake3_hasher_reset(blake3_hasher *self);
 
+// vaultx extension: hashes num_inputs inputs of input_len bytes each
+// (input_len <= BLAKE3_BLOCK_LEN) and writes the first out_len bytes of each
+// hash to out, out_len bytes apart. Equivalent to running
+// blake3_hasher_init/update/finalize on every input, but several inputs are
+// compressed at once on the widest SIMD unit available.
+BLAKE3_API void blake3_hash_many_nonce(const uint8_t *const *inputs,
+                                       size_t num_inputs, size_t input_len,
+                                       uint8_t *out, size_t out_len);
+
+// vaultx extension: same as blake3_hash_many_nonce() for a single input,
+// using one compression instead of a full blake3_hasher.
+BLAKE3_API void blake3_hash_nonce(const uint8_t *input, size_t input_len,
+                                  uint8_t *out, size_t out_len);
+
+// vaultx extension: for every nonce in [start, start + count), hashes its
+// nonce_len (<= 8) low bytes in little-endian order and writes the first
+// prefix_len (<= 4) bytes of the hash, read big-endian, to out[i]. This is
+// the bucket index of nonce start + i; the nonces are generated from the
+// counter inside the SIMD kernel instead of being read from memory.
+BLAKE3_API void blake3_nonce_prefixes(uint64_t start, size_t count,
+                                      size_t nonce_len, size_t prefix_len,
+                                      uint32_t *out);
+
 #ifdef __cplusplus
 }
 #endif
@@ -272,6 +272,52 @@ void blake3_hash_many(const uint8_t *const *inputs, size_t num_inputs,
                             out);
 }
 
+void blake3_hash_many_nonce(const uint8_t *const *inputs, size_t num_inputs,
+                            size_t input_len, uint8_t *out, size_t out_len) {
+  assert(input_len <= BLAKE3_BLOCK_LEN);
+  assert(out_len <= BLAKE3_BLOCK_LEN);
+#if defined(IS_X86) && defined(__GNUC__)
+  const enum cpu_feature features = get_cpu_features();
+  MAYBE_UNUSED(features);
+#if !defined(BLAKE3_NO_AVX512)
+  if (features & AVX512F) {
+    blake3_hash_many_nonce_avx512(inputs, num_inputs, input_len, out, out_len);
+    return;
+  }
+#endif
+#if !defined(BLAKE3_NO_AVX2)
+  if (features & AVX2) {
+    blake3_hash_many_nonce_avx2(inputs, num_inputs, input_len, out, out_len);
+    return;
+  }
+#endif
+#endif
+  blake3_hash_many_nonce_portable(inputs, num_inputs, input_len, out, out_len);
+}
+
+void blake3_nonce_prefixes(uint64_t start, size_t count, size_t nonce_len,
+                           size_t prefix_len, uint32_t *out) {
+  assert(nonce_len >= 1 && nonce_len <= 8);
+  assert(prefix_len >= 1 && prefix_len <= 4);
+#if defined(IS_X86) && defined(__GNUC__)
+  const enum cpu_feature features = get_cpu_features();
+  MAYBE_UNUSED(features);
+#if !defined(BLAKE3_NO_AVX512)
+  if (features & AVX512F) {
+    blake3_nonce_prefixes_avx512(start, count, nonce_len, prefix_len, out);
+    return;
+  }
+#endif
+#if !defined(BLAKE3_NO_AVX2)
+  if (features & AVX2) {
+    blake3_nonce_prefixes_avx2(start, count, nonce_len, prefix_len, out);
+    return;
+  }
+#endif
+#endif
+  blake3_nonce_prefixes_portable(start, count, nonce_len, prefix_len, out);
+}
+
 // The dynamically detected SIMD degree of the current platform.
 size_t blake3_simd_degree(void) {
 #if defined(IS_X86)
@@ -216,6 +216,14 @@ void blake3_hash_many_portable(const uint8_t *const *inputs, size_t num_inputs,
                                uint8_t flags, uint8_t flags_start,
                                uint8_t flags_end, uint8_t *out);
 
+void blake3_hash_many_nonce_portable(const uint8_t *const *inputs,
+                                     size_t num_inputs, size_t input_len,
+                                     uint8_t *out, size_t out_len);
+
+void blake3_nonce_prefixes_portable(uint64_t start, size_t count,
+                                    size_t nonce_len, size_t prefix_len,
+                                    uint32_t *out);
+
 #if defined(IS_X86)
 #if !defined(BLAKE3_NO_SSE2)
 void blake3_compress_in_place_sse2(uint32_t cv[8],
@@ -253,6 +261,12 @@ void blake3_hash_many_avx2(const uint8_t *const *inputs, size_t num_inputs,
                            uint64_t counter, bool increment_counter,
                            uint8_t flags, uint8_t flags_start,
                            uint8_t flags_end, uint8_t *out);
+void blake3_hash_many_nonce_avx2(const uint8_t *const *inputs,
+                                 size_t num_inputs, size_t input_len,
+                                 uint8_t *out, size_t out_len);
+void blake3_nonce_prefixes_avx2(uint64_t start, size_t count,
+                                size_t nonce_len, size_t prefix_len,
+                                uint32_t *out);
 #endif
 #if !defined(BLAKE3_NO_AVX512)
 void blake3_compress_in_place_avx512(uint32_t cv[8],
@@ -270,6 +284,14 @@ void blake3_hash_many_avx512(const uint8_t *const *inputs, size_t num_inputs,
                              uint64_t counter, bool increment_counter,
                              uint8_t flags, uint8_t flags_start,
                              uint8_t flags_end, uint8_t *out);
+
+void blake3_hash_many_nonce_avx512(const uint8_t *const *inputs,
+                                   size_t num_inputs, size_t input_len,
+                                   uint8_t *out, size_t out_len);
+
+void blake3_nonce_prefixes_avx512(uint64_t start, size_t count,
+                                  size_t nonce_len, size_t prefix_len,
+                                  uint32_t *out);
 #endif
 #endif
 
@@ -0,0 +1,263 @@
+#include "blake3_impl.h"
+#include <string.h>
+
+// Multi-lane hashing of short inputs for vaultx.
+//
+// A nonce is at most a few bytes long, so its BLAKE3 hash is a single
+// compression of one zero-padded block with CHUNK_START | CHUNK_END | ROOT,
+// a counter of 0 and block_len equal to the input length. That last detail
+// is why blake3_hash_many() cannot be used here: its kernels always compress
+// full BLAKE3_BLOCK_LEN blocks. The kernels below keep one message block and
+// one state per lane in structure-of-arrays form, so the lane loops compile
+// down to one vector instruction per step at the width of the target.
+
+#define NONCE_MAX_LANES 16
+
+INLINE uint32_t rotr32_nonce(uint32_t w, uint32_t c) {
+  return (w >> c) | (w << (32 - c));
+}
+
+INLINE void g_lanes(uint32_t v[16][NONCE_MAX_LANES], size_t lanes, size_t a,
+                    size_t b, size_t c, size_t d, const uint32_t *x,
+                    const uint32_t *y) {
+  for (size_t l = 0; l < lanes; l++) {
+    v[a][l] = v[a][l] + v[b][l] + x[l];
+    v[d][l] = rotr32_nonce(v[d][l] ^ v[a][l], 16);
+    v[c][l] = v[c][l] + v[d][l];
+    v[b][l] = rotr32_nonce(v[b][l] ^ v[c][l], 12);
+    v[a][l] = v[a][l] + v[b][l] + y[l];
+    v[d][l] = rotr32_nonce(v[d][l] ^ v[a][l], 8);
+    v[c][l] = v[c][l] + v[d][l];
+    v[b][l] = rotr32_nonce(v[b][l] ^ v[c][l], 7);
+  }
+}
+
+INLINE void round_lanes(uint32_t v[16][NONCE_MAX_LANES],
+                        uint32_t m[16][NONCE_MAX_LANES], size_t lanes,
+                        size_t round) {
+  const uint8_t *schedule = MSG_SCHEDULE[round];
+
+  // Mix the columns.
+  g_lanes(v, lanes, 0, 4, 8, 12, m[schedule[0]], m[schedule[1]]);
+  g_lanes(v, lanes, 1, 5, 9, 13, m[schedule[2]], m[schedule[3]]);
+  g_lanes(v, lanes, 2, 6, 10, 14, m[schedule[4]], m[schedule[5]]);
+  g_lanes(v, lanes, 3, 7, 11, 15, m[schedule[6]], m[schedule[7]]);
+
+  // Mix the rows.
+  g_lanes(v, lanes, 0, 5, 10, 15, m[schedule[8]], m[schedule[9]]);
+  g_lanes(v, lanes, 1, 6, 11, 12, m[schedule[10]], m[schedule[11]]);
+  g_lanes(v, lanes, 2, 7, 8, 13, m[schedule[12]], m[schedule[13]]);
+  g_lanes(v, lanes, 3, 4, 9, 14, m[schedule[14]], m[schedule[15]]);
+}
+
+// Runs the single root compression for `lanes` message blocks that are
+// already transposed into m[word][lane], leaving the final state in v.
+INLINE void compress_lanes(uint32_t v[16][NONCE_MAX_LANES],
+                           uint32_t m[16][NONCE_MAX_LANES], size_t lanes,
+                           uint8_t block_len) {
+  for (size_t l = 0; l < lanes; l++) {
+    v[0][l] = IV[0];
+    v[1][l] = IV[1];
+    v[2][l] = IV[2];
+    v[3][l] = IV[3];
+    v[4][l] = IV[4];
+    v[5][l] = IV[5];
+    v[6][l] = IV[6];
+    v[7][l] = IV[7];
+    v[8][l] = IV[0];
+    v[9][l] = IV[1];
+    v[10][l] = IV[2];
+    v[11][l] = IV[3];
+    v[12][l] = 0;
+    v[13][l] = 0;
+    v[14][l] = (uint32_t)block_len;
+    v[15][l] = (uint32_t)(CHUNK_START | CHUNK_END | ROOT);
+  }
+
+  round_lanes(v, m, lanes, 0);
+  round_lanes(v, m, lanes, 1);
+  round_lanes(v, m, lanes, 2);
+  round_lanes(v, m, lanes, 3);
+  round_lanes(v, m, lanes, 4);
+  round_lanes(v, m, lanes, 5);
+  round_lanes(v, m, lanes, 6);
+}
+
+// Writes out_len bytes of output per lane to out (lane-major, out_len bytes
+// apart). Output words 0..7 are the chaining value, 8..15 the extended
+// output of blake3_compress_xof(); only what the caller asked for is built.
+INLINE void store_lanes(uint32_t v[16][NONCE_MAX_LANES], size_t lanes,
+                        uint8_t *out, size_t out_len) {
+  uint32_t words[16][NONCE_MAX_LANES];
+  size_t out_words = (out_len + 3) / 4;
+  for (size_t w = 0; w < out_words && w < 8; w++) {
+    for (size_t l = 0; l < lanes; l++) {
+      words[w][l] = v[w][l] ^ v[w + 8][l];
+    }
+  }
+  for (size_t w = 8; w < out_words; w++) {
+    for (size_t l = 0; l < lanes; l++) {
+      words[w][l] = v[w][l] ^ IV[w - 8];
+    }
+  }
+
+  for (size_t l = 0; l < lanes; l++) {
+    uint8_t bytes[BLAKE3_BLOCK_LEN];
+    for (size_t w = 0; w < out_words; w++) {
+      store32(&bytes[w * 4], words[w][l]);
+    }
+    memcpy(&out[l * out_len], bytes, out_len);
+  }
+}
+
+INLINE void hash_lanes(const uint8_t *const *inputs, size_t lanes,
+                       size_t input_len, uint8_t *out, size_t out_len) {
+  uint32_t m[16][NONCE_MAX_LANES];
+  for (size_t l = 0; l < lanes; l++) {
+    uint8_t block[BLAKE3_BLOCK_LEN] = {0};
+    memcpy(block, inputs[l], input_len);
+    for (size_t w = 0; w < 16; w++) {
+      m[w][l] = load32(&block[w * 4]);
+    }
+  }
+  uint32_t v[16][NONCE_MAX_LANES];
+  compress_lanes(v, m, lanes, (uint8_t)input_len);
+  store_lanes(v, lanes, out, out_len);
+}
+
+INLINE void hash_many_lanes(const uint8_t *const *inputs, size_t num_inputs,
+                            size_t lanes, size_t input_len, uint8_t *out,
+                            size_t out_len) {
+  while (num_inputs >= lanes) {
+    hash_lanes(inputs, lanes, input_len, out, out_len);
+    inputs += lanes;
+    num_inputs -= lanes;
+    out = &out[lanes * out_len];
+  }
+  while (num_inputs > 0) {
+    hash_lanes(inputs, 1, input_len, out, out_len);
+    inputs += 1;
+    num_inputs -= 1;
+    out = &out[out_len];
+  }
+}
+
+// Counter-native variant for plot generation: lane l hashes the nonce
+// start + l, built directly from the counter (its nonce_len low bytes,
+// little-endian, as memcpy(&seed) would lay them out), and only the first
+// prefix_len bytes of its hash are kept, as a big-endian bucket index. No
+// nonce is ever materialized in memory.
+INLINE void prefix_lanes(uint64_t start, size_t lanes, size_t nonce_len,
+                         size_t prefix_len, uint32_t *out) {
+  const uint32_t mask_low =
+      nonce_len >= 4 ? 0xFFFFFFFFUL : (1UL << (8 * nonce_len)) - 1;
+  const uint32_t mask_high =
+      nonce_len >= 8 ? 0xFFFFFFFFUL
+      : nonce_len <= 4 ? 0 : (1UL << (8 * (nonce_len - 4))) - 1;
+
+  uint32_t m[16][NONCE_MAX_LANES] = {{0}};
+  for (size_t l = 0; l < lanes; l++) {
+    uint64_t nonce = start + l;
+    m[0][l] = counter_low(nonce) & mask_low;
+    m[1][l] = counter_high(nonce) & mask_high;
+  }
+
+  uint32_t v[16][NONCE_MAX_LANES];
+  compress_lanes(v, m, lanes, (uint8_t)nonce_len);
+
+  for (size_t l = 0; l < lanes; l++) {
+    uint32_t w = v[0][l] ^ v[8][l];
+    w = (w << 24) | ((w & 0xFF00) << 8) | ((w >> 8) & 0xFF00) | (w >> 24);
+    out[l] = w >> (32 - 8 * prefix_len);
+  }
+}
+
+INLINE void prefixes_many_lanes(uint64_t start, size_t count, size_t lanes,
+                                size_t nonce_len, size_t prefix_len,
+                                uint32_t *out) {
+  while (count >= lanes) {
+    prefix_lanes(start, lanes, nonce_len, prefix_len, out);
+    start += lanes;
+    count -= lanes;
+    out += lanes;
+  }
+  while (count > 0) {
+    prefix_lanes(start, 1, nonce_len, prefix_len, out);
+    start += 1;
+    count -= 1;
+    out += 1;
+  }
+}
+
+// Hashes a single input of at most BLAKE3_BLOCK_LEN bytes with one call to
+// the dispatched compression function. Unlike blake3_hasher, nothing but the
+// 64-byte block and the 8-word chaining value lives on the stack.
+void blake3_hash_nonce(const uint8_t *input, size_t input_len, uint8_t *out,
+                       size_t out_len) {
+  assert(input_len <= BLAKE3_BLOCK_LEN);
+  assert(out_len <= BLAKE3_BLOCK_LEN);
+  uint8_t block[BLAKE3_BLOCK_LEN] = {0};
+  memcpy(block, input, input_len);
+
+  const uint8_t flags = CHUNK_START | CHUNK_END | ROOT;
+  if (out_len <= BLAKE3_OUT_LEN) {
+    uint32_t cv[8];
+    memcpy(cv, IV, BLAKE3_KEY_LEN);
+    blake3_compress_in_place(cv, block, (uint8_t)input_len, 0, flags);
+    uint8_t bytes[BLAKE3_OUT_LEN];
+    store_cv_words(bytes, cv);
+    memcpy(out, bytes, out_len);
+  } else {
+    uint8_t bytes[BLAKE3_BLOCK_LEN];
+    blake3_compress_xof(IV, block, (uint8_t)input_len, 0, flags, bytes);
+    memcpy(out, bytes, out_len);
+  }
+}
+
+// The portable kernel uses 4 lanes, which the compiler maps onto SSE2 on
+// x86-64 and NEON on AArch64 without any target-specific code.
+void blake3_hash_many_nonce_portable(const uint8_t *const *inputs,
+                                     size_t num_inputs, size_t input_len,
+                                     uint8_t *out, size_t out_len) {
+  hash_many_lanes(inputs, num_inputs, 4, input_len, out, out_len);
+}
+
+void blake3_nonce_prefixes_portable(uint64_t start, size_t count,
+                                    size_t nonce_len, size_t prefix_len,
+                                    uint32_t *out) {
+  prefixes_many_lanes(start, count, 4, nonce_len, prefix_len, out);
+}
+
+#if defined(IS_X86) && defined(__GNUC__)
+#if !defined(BLAKE3_NO_AVX2)
+__attribute__((target("avx2")))
+void blake3_hash_many_nonce_avx2(const uint8_t *const *inputs,
+                                 size_t num_inputs, size_t input_len,
+                                 uint8_t *out, size_t out_len) {
+  hash_many_lanes(inputs, num_inputs, 8, input_len, out, out_len);
+}
+
+__attribute__((target("avx2")))
+void blake3_nonce_prefixes_avx2(uint64_t start, size_t count,
+                                size_t nonce_len, size_t prefix_len,
+                                uint32_t *out) {
+  prefixes_many_lanes(start, count, 8, nonce_len, prefix_len, out);
+}
+#endif
+
+#if !defined(BLAKE3_NO_AVX512)
+__attribute__((target("avx512f")))
+void blake3_hash_many_nonce_avx512(const uint8_t *const *inputs,
+                                   size_t num_inputs, size_t input_len,
+                                   uint8_t *out, size_t out_len) {
+  hash_many_lanes(inputs, num_inputs, 16, input_len, out, out_len);
+}
+
+__attribute__((target("avx512f")))
+void blake3_nonce_prefixes_avx512(uint64_t start, size_t count,
+                                  size_t nonce_len, size_t prefix_len,
+                                  uint32_t *out) {
+  prefixes_many_lanes(start, count, 16, nonce_len, prefix_len, out);
+}
+#endif
+#endif
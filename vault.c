@@ -175,12 +175,8 @@ void generateBlake3(MemoRecord *record, unsigned long long seed)
 	//     record->nonce[i] = (seed >> (i * 8)) & 0xFF;
 	//     }
 
-	// Generate random bytes
-	blake3_hasher hasher;
-	blake3_hasher_init(&hasher);
-	blake3_hasher_update(&hasher, &record->nonce, sizeof(record->nonce));
-	// blake3_hasher_update(&hasher, &seed, sizeof(seed));
-	blake3_hasher_finalize(&hasher, record->hash, RECORD_SIZE - NONCE_SIZE);
+	// Generate random bytes (a nonce always fits in a single block)
+	blake3_hash_nonce(record->nonce, sizeof(record->nonce), record->hash, RECORD_SIZE - NONCE_SIZE);
 }
 
 // Function to be executed by each thread for array generation
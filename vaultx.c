@@ -1,3 +1,7 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // For O_DIRECT and sync_file_range
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <omp.h>
@@ -9,17 +13,37 @@
 #include <fcntl.h>     // For open, O_RDWR, O_CREAT, O_TRUNC
 #include <sys/types.h> // For data types
 #include <sys/stat.h>  // For file modes
+#include <sys/mman.h>  // For mmap, madvise
+#include <sys/resource.h> // For getrusage
 #include <math.h>
 #include <errno.h>
+#include <pthread.h>
+#include <limits.h>  // For IOV_MAX
+#include <sys/uio.h> // For preadv
+
+#if defined(__SSE2__)
+#include <emmintrin.h> // For the shuffle's vector copies and non-temporal stores
+#endif
 
 #ifdef __linux__
-#include <linux/fs.h> // Provides `syncfs` on Linux
+#include <linux/fs.h> // Provides FS_IOC_FIEMAP on Linux
+#include <linux/fiemap.h> // For counting the extents of the final file
+#include <sys/ioctl.h>
+#endif
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h> // Raw io_uring interface, no liburing needed
+#include <sys/syscall.h>    // For io_uring_setup and io_uring_enter
+#define HAVE_IO_URING 1
+#endif
 #endif
 
 #ifdef __cplusplus
 // Your C++-specific code here
 #include <tbb/parallel_for.h>
 #include <tbb/blocked_range.h>
+#include <tbb/task_arena.h>
 #endif
 
 #include "blake3.h" // Include Blake3 header
@@ -34,6 +58,68 @@
 
 #define HASH_SIZE (RECORD_SIZE - NONCE_SIZE)
 #define PREFIX_SIZE 3 // Example prefix size for getBucketIndex
+#define HASHGEN_LANES 64 // Consecutive nonces hashed per blake3_nonce_prefixes call
+#define HUGE_PAGE_SIZE (2ULL * 1024 * 1024) // Alignment of the bucket arena
+#define BUCKET_COUNT_MAX UINT16_MAX // Largest fill count a bucket_count_t can hold
+#define STAGING_PARTITION_BITS 8 // High bucket index bits that select a staging partition
+#define STAGING_PARTITIONS (1 << STAGING_PARTITION_BITS)
+#define STAGING_ENTRIES 64 // Entries per staging partition, flushed as one run
+#define STAGING_LOW_BITS (PREFIX_SIZE * 8 - STAGING_PARTITION_BITS)
+#define STAGING_LOW_MASK ((1ULL << STAGING_LOW_BITS) - 1)
+#define IO_CHUNK_SIZE (8ULL * 1024 * 1024) // Largest single read or write request
+#define LOOKUP_WILLNEED_AHEAD 16            // Spans or lookups prefetched ahead in LOOKUP_MMAP_WILLNEED mode
+#define PLOT_FOOTER_MAGIC 0x544f4c5058544c56ULL // "VLTXPLOT" in little-endian byte order
+#define PLOT_FOOTER_VERSION 2
+#define PLOT_FOOTER_V1_SIZE 40 // Version 1 footers end before the flags
+#define PLOT_FLAG_HASH_SORTED 0x1 // Every bucket holds its nonces in ascending order of their hash, empty records last
+#define HASH_SORT_BATCH_SIZE (64ULL * 1024 * 1024) // Plot data sorted per read and write of the hash sort pass
+#define HASH_SORT_INSERTION_MAX 32                 // Largest bucket sorted by insertion instead of qsort
+#define HASH_SORT_CHUNK_RECORDS 4096               // Records hashed by one call of the hash sort
+#define SHUFFLE_RING_SLOTS 2 // Groups in flight per stage of the shuffle pipeline
+#define TRANSPOSE_TILE_BYTES (256 * 1024) // Output staged in cache per transpose tile
+#define TRANSPOSE_BENCH_ITERATIONS 5
+#define SHUFFLE_MAX_PASSES 4 // Most passes the shuffle planner considers
+#define COPY_CHUNK_SIZE (64ULL * 1024 * 1024) // Unit of work of the parallel cross-device copy
+
+#define WRITEBACK_MAX_RANGES 256 // Ranges a writeback governor tracks before it waits for the oldest
+#define WRITEBACK_CHUNK_SIZE (64ULL * 1024 * 1024) // Unit handed to the writeback governor by single large writes
+#define MAX_STRIPES 16 // Most directories a plot can be striped across
+#define STRIPE_MANIFEST_MAGIC "VAULTX-STRIPES"
+#define SCATTER_MIN_RUN_BYTES 4096 // Shorter runs are read through a bounce buffer instead of preadv
+
+#ifndef POSIX_FADV_NORMAL
+// No posix_fadvise (macOS), advise_file ignores the hints
+#define POSIX_FADV_SEQUENTIAL 0
+#define POSIX_FADV_WILLNEED 0
+#define POSIX_FADV_DONTNEED 0
+#endif
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024 // Scatter list entries per preadv call
+#endif
+
+// I/O backends for the temporary and final files
+typedef enum
+{
+    IO_BACKEND_SYNC, // Blocking pread/pwrite, one request at a time
+    IO_BACKEND_URING // io_uring with up to queue_depth requests in flight
+} IoBackendKind;
+
+// How lookups get at the buckets of a plot
+typedef enum
+{
+    LOOKUP_READ,         // pread each bucket into a buffer
+    LOOKUP_MMAP,         // Map the plot with MADV_RANDOM and hash buckets straight from the mapping
+    LOOKUP_MMAP_WILLNEED // As LOOKUP_MMAP, and prefetch the buckets of pending challenges with MADV_WILLNEED
+} LookupMode;
+
+// How plot files are reserved on disk before they are written
+typedef enum
+{
+    PREALLOCATE_OFF,       // Let the file system grow files write by write
+    PREALLOCATE_ON,        // Reserve the whole file up front
+    PREALLOCATE_CONTIGUOUS // Reserve the whole file and insist on one extent where the OS can
+} PreallocateMode;
 
 unsigned long long num_buckets = 1;
 unsigned long long num_records_in_bucket = 1;
@@ -49,6 +135,30 @@ bool MEMORY_WRITE = true;
 bool CIRCULAR_ARRAY = false;
 bool BENCHMARK = false;
 bool HASHGEN = true;
+bool PIPELINE = false;
+bool DIRECT_IO = false;
+#ifdef HAVE_IO_URING
+IoBackendKind IO_BACKEND = IO_BACKEND_URING;
+#else
+IoBackendKind IO_BACKEND = IO_BACKEND_SYNC;
+#endif
+unsigned QUEUE_DEPTH = 8;
+unsigned LOOKUP_DEPTH = 0; // Bucket reads in flight for batch lookups, 0 sorts and coalesces them instead
+LookupMode LOOKUP_MODE = LOOKUP_READ;
+unsigned long long DIRECT_FINAL_KB = 0;
+bool IN_MEMORY = false;      // Keep the whole plot resident and skip the temporary file
+bool IN_MEMORY_AUTO = false; // Decide IN_MEMORY from the memory available at startup
+bool TRANSPOSE_BENCH = false;
+bool HASH_SORT = false; // Sort each bucket of the final plot by hash so lookups can binary-search it
+bool SHUFFLE_IN_PLACE = false; // Scatter reads straight into transposed order, no output ring
+int SHUFFLE_PASSES = 0;        // 0 lets the planner choose
+unsigned long long SHUFFLE_MIN_READ_KB = 0;
+double SEEK_TIME_MS = 8.0;       // Cost model of the shuffle planner, an HDD by default
+double DISK_BANDWIDTH_MBPS = 150.0;
+PreallocateMode PREALLOCATE = PREALLOCATE_ON;
+char *STRIPE_DIRS[MAX_STRIPES]; // Directories of a striped plot, one stripe each
+int NUM_STRIPES = 1;
+unsigned long long WRITEBACK_LIMIT_MB = 256; // Most dirty plot data allowed under writeback, 0 leaves it to the kernel
 bool SEARCH = false;
 bool SEARCH_BATCH = false;
 size_t PREFIX_SEARCH_SIZE = 1;
@@ -67,12 +177,268 @@ typedef struct
     uint8_t nonce[NONCE_SIZE]; // Nonce to store the seed
 } MemoRecord;
 
+// Where the records of each bucket live in a final plot file. Bucket b is
+// split into `slices` runs of records_in_slice records; the buckets are
+// grouped group_buckets at a time, and a group stores slice 0 of all its
+// buckets, then slice 1, and so on. With group_buckets == 1 every bucket is
+// contiguous, which is the classic bucket-major layout of the shuffle
+typedef struct
+{
+    unsigned long long slices;           // Runs a bucket is split into, one per round
+    unsigned long long records_in_slice; // Records per run
+    unsigned long long group_buckets;    // Buckets per group
+    unsigned long long flags;            // PLOT_FLAG_* bits from the footer
+} PlotLayout;
+
+// Trailer of plot files written with group_buckets > 1 or with flags; a classic
+// plot without flags has none. It is shorter than one record per bucket, so sizing
+// the file by whole records per bucket is unaffected
+typedef struct
+{
+    uint64_t magic;
+    uint32_t version;
+    uint32_t nonce_size;
+    uint64_t slices;
+    uint64_t records_in_slice;
+    uint64_t group_buckets;
+    uint64_t flags; // Since version 2
+} PlotFooter;
+
+// A record with the leading bytes of its hash, for sorting a bucket by hash
+typedef struct
+{
+    uint64_t key; // First 8 bytes of the hash, big-endian
+    MemoRecord record;
+} HashSortEntry;
+
+// The files of a plot: a single file, or a stripe set whose manifest lists one
+// file per stripe, stripe k holding buckets [k * stripe_buckets, (k + 1) * stripe_buckets)
+// as a plot of its own. All stripes share one layout
+typedef struct
+{
+    int count;
+    unsigned long long stripe_buckets;
+    char *paths[MAX_STRIPES];
+    PlotLayout layout;
+} PlotStripes;
+
+// A plot opened for lookups. Nothing in it changes after plot_reader_open and
+// buckets are read with pread, so any number of threads can share one reader,
+// each passing a buffer of records_in_bucket records of its own
+typedef struct
+{
+    PlotStripes stripes;
+    int fds[MAX_STRIPES];
+    LookupMode mode;                   // LOOKUP_READ if the plot could not be mapped
+    const MemoRecord *maps[MAX_STRIPES]; // Mapping of each stripe in the mmap modes
+    size_t map_sizes[MAX_STRIPES];
+    unsigned long long records_in_bucket;
+} PlotReader;
+
+// A challenge of a batch lookup: the bucket it falls in and its position in the batch
+typedef struct
+{
+    unsigned long long bucket;
+    size_t index;
+} LookupChallenge;
+
+// Per-thread buffers of a batch lookup: the records of a span of adjacent buckets,
+// and the nonzero nonces of one bucket with their hashes
 typedef struct
 {
     MemoRecord *records;
-    size_t count; // Number of records in the bucket
-    size_t flush; // Number of flushes of bucket
-} Bucket;
+    const uint8_t **nonces;
+    uint8_t *hashes;
+} LookupScratch;
+
+// Sustained rate and per-lookup latency of a run of the async lookup engine
+typedef struct
+{
+    IoBackendKind backend; // io_uring, or sync for the thread pool
+    unsigned queue_depth;  // Bucket reads kept in flight
+    double seconds;
+    double mean_us;
+    double p50_us;
+    double p99_us;
+    double max_us;
+} LookupStats;
+
+// Number of records in a bucket; 2 bytes per bucket keeps the metadata of
+// 2^24 buckets at 32 MB
+typedef uint16_t bucket_count_t;
+
+// All buckets of a round live in one arena; bucket i's records start at
+// records[i * bucket_stride + slice_offset], so no per-bucket pointer is stored.
+// A round's own table has a stride of num_records_in_bucket; an in-memory plot
+// is a single table holding every round, each round filling its slice of a bucket
+typedef struct
+{
+    MemoRecord *records;   // Arena of num_buckets * bucket_stride records
+    size_t bucket_stride;  // Records from the start of one bucket to the next
+    size_t slice_offset;   // Records from the start of a bucket to the current round's slice
+    size_t arena_size;     // Size of the arena mapping in bytes
+    bool huge_pages;       // Arena is backed by MAP_HUGETLB pages
+    bucket_count_t *counts; // Dense array of per-bucket fill counts
+    omp_lock_t locks[STAGING_PARTITIONS]; // One writer per staging partition's buckets at a time
+} BucketTable;
+
+// Per-thread staging area for two-phase bucketing: hashes are first
+// partitioned by the high bits of their bucket index into small, cache
+// resident runs, and a full run is then copied into its buckets in one go
+// under the partition's lock, instead of one atomic per record
+typedef struct
+{
+    uint64_t entries[STAGING_PARTITIONS][STAGING_ENTRIES]; // (nonce << STAGING_LOW_BITS) | low bucket index bits
+    uint16_t fill[STAGING_PARTITIONS];                     // Number of entries staged per partition
+} StagingBuffer;
+
+// A read or write owned by an I/O queue slot
+typedef struct
+{
+    int fd;
+    uint8_t *buf;  // Next byte to transfer
+    size_t len;    // Bytes left to transfer
+    off_t offset;  // File offset of buf
+    bool write;
+    uint64_t tag;  // Returned by io_queue_wait once the request is done
+    bool busy;
+} IoRequest;
+
+// Queue of reads and writes; one thread at a time may use a queue
+typedef struct
+{
+    IoBackendKind kind;
+    unsigned queue_depth;
+    unsigned in_flight;
+    IoRequest *requests;       // queue_depth slots, a slot's index is its io_uring user_data
+    uint64_t *completed;       // Tags of finished requests not yet returned by io_queue_wait
+    size_t num_completed;
+    size_t completed_capacity;
+#ifdef HAVE_IO_URING
+    int ring_fd;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+#endif
+} IoQueue;
+
+// Writeback governor: each range is handed to the device as soon as it is
+// written, and once more than limit bytes are under writeback the oldest
+// ranges are waited for, so dirty pages never pile up in the page cache
+typedef struct
+{
+    int fd;
+    unsigned long long limit;   // 0 disables the governor
+    unsigned long long pending; // Bytes under writeback that were not waited for yet
+    off_t offsets[WRITEBACK_MAX_RANGES];
+    off_t lengths[WRITEBACK_MAX_RANGES];
+    unsigned head;              // Oldest range
+    unsigned count;
+    double wait_time;           // Time spent waiting for the device
+    pthread_mutex_t mutex;      // The parallel cross-device copy shares a governor
+} WritebackGovernor;
+
+// Counting semaphore, as in vault.c
+typedef struct
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t condition;
+    int count;
+} semaphore_t;
+
+// A round's bucket table handed to the writer thread in pipelined mode
+typedef struct
+{
+    const BucketTable *table; // Table holding the round's buckets
+    IoQueue *io;              // Queue the round is written through
+    WritebackGovernor *writeback;
+    const PlotLayout *layout; // Final file layout, NULL when writing the temporary file
+    int fd;                   // Temporary file
+    unsigned long long first_bucket;   // Buckets of the stripe this writer owns
+    unsigned long long stripe_buckets;
+    unsigned long long round; // Round whose slot of the file is written
+    double start_time;        // Walltime when the writer started draining the table
+    double end_time;          // Walltime when the last bucket was handed to the file
+} RoundWrite;
+
+// Shuffle pipeline: a reader thread fills the input ring, the main thread
+// transposes from the input ring into the output ring, and a writer thread
+// drains the output ring, so group i+1 is read while group i is transposed
+// and group i-1 is written. Group g always uses slot g % SHUFFLE_RING_SLOTS
+typedef struct
+{
+    int fd_src;
+    int fd_dest;
+    int num_threads_io;
+    int stripe;                       // Stripe being shuffled, -1 for a plot that is not striped
+    unsigned long long num_buckets;   // Buckets in the files being shuffled
+    unsigned long long slices;        // Source slices merged into one destination slice
+    unsigned long long slice_records; // Records of a bucket in a source slice
+    unsigned long long first_slice;   // First source slice of the current destination slice
+    unsigned long long dest_slice;    // Destination slice being written
+    unsigned long long num_buckets_to_read;
+    unsigned long long num_groups;    // Groups of buckets per destination slice
+    size_t records_per_batch;   // Records of one source slice of a group
+    size_t buffer_size;         // Records of a whole group
+    bool in_place;              // Reads land in transposed order and output[] aliases input[]
+    MemoRecord *input[SHUFFLE_RING_SLOTS];
+    MemoRecord *output[SHUFFLE_RING_SLOTS];
+    size_t arena_size;          // Mapping size of each ring buffer
+    WritebackGovernor writeback; // Destination writeback, driven by the writer
+    semaphore_t input_free;
+    semaphore_t input_full;
+    semaphore_t output_free;
+    semaphore_t output_full;
+    double input_read_time[SHUFFLE_RING_SLOTS];  // Set by the reader for the group in the input slot
+    double output_read_time[SHUFFLE_RING_SLOTS]; // Carried over by the transpose stage
+    double output_transpose_time[SHUFFLE_RING_SLOTS];
+    double elapsed_time_read_total;
+    double elapsed_time_transpose_total;
+    double elapsed_time_write_total;
+    double start_time;          // Walltime of the run, for progress lines
+    double last_group_time;     // Walltime when the previous group was written
+    int pass;                   // Current pass, from 0, and number of passes
+    int num_passes;
+    unsigned long long groups_done;    // Groups of this pass written before the current destination slice
+    unsigned long long groups_in_pass;
+} ShufflePipeline;
+
+// Shuffle plan: the temporary file holds rounds slices; pass i merges every
+// factors[i] adjacent slices into one, and the last pass leaves a single slice,
+// which is the final file. One pass with factors[0] == rounds is the classic shuffle
+typedef struct
+{
+    int num_passes;
+    unsigned long long factors[SHUFFLE_MAX_PASSES];
+    double predicted_seconds;
+    double single_pass_seconds;
+    unsigned long long min_read_bytes; // Smallest read of any pass
+} ShufflePlan;
+
+// One stripe's share of the shuffle; the stripes of a striped plot are shuffled
+// by one thread each, every stripe on its own drive
+typedef struct
+{
+    char *temp_name;
+    char *final_name;
+    const ShufflePlan *plan;
+    unsigned long long stripe_buckets;
+    unsigned long long memory_bytes;
+    int num_threads_io;
+    double start_time;
+    int stripe;          // -1 for a plot that is not striped
+    double elapsed_time; // Sum of the passes' walltimes
+} StripeShuffle;
 
 // Function to display usage information
 void print_usage(char *prog_name)
@@ -85,6 +451,24 @@ void print_usage(char *prog_name)
     printf("  -m, --memory NUM             Memory size in MB (default: 1)\n");
     printf("  -f, --file NAME              Output file name\n");
     printf("  -b, --batch-size NUM         Batch size (default: 1024)\n");
+    printf("  -P, --pipeline [true|false]  Hash the next round while a writer thread drains the previous one (default: false)\n");
+    printf("  -D, --direct_io [true|false] Write rounds to the temporary file with O_DIRECT (default: false)\n");
+    printf("  -I, --io_backend [sync|io_uring] I/O backend for round writes and shuffle (default: io_uring on Linux)\n");
+    printf("  -Q, --queue_depth NUM        Reads and writes kept in flight (default: 8)\n");
+    printf("  -l, --lookup_depth NUM       Bucket reads kept in flight by -b lookups through the -I backend, 0 sorts and coalesces them instead (default: 0)\n");
+    printf("  -o, --lookup_mode [read|mmap|mmap_willneed] Read buckets for lookups, or hash them from a mapping of the plot, optionally prefetching pending ones (default: read)\n");
+    printf("  -F, --direct_final NUM       Write rounds straight into the final file in groups of at least NUM KB, skipping the shuffle (default: 0, off)\n");
+    printf("  -M, --in_memory [auto|true|false] Keep the whole plot in memory and write the final file once, with no temporary file; auto does so if it fits in free memory. Either overrides -m (default: false)\n");
+    printf("  -S, --shuffle_in_place [true|false] Scatter shuffle reads into final order, twice the group size for the same memory (default: false)\n");
+    printf("  -L, --shuffle_passes NUM     Shuffle passes, each merging groups of rounds into an intermediate file (default: 0, planner decides)\n");
+    printf("  -R, --min_read NUM           Smallest shuffle read in KB the planner aims for (default: 0)\n");
+    printf("  -E, --seek_time NUM          Seek time in ms assumed by the shuffle planner (default: 8)\n");
+    printf("  -B, --disk_bandwidth NUM     Disk bandwidth in MB/s assumed by the shuffle planner (default: 150)\n");
+    printf("  -W, --writeback_limit NUM    Most MB of plot data left dirty before writes wait for the device, 0 leaves writeback to the kernel (default: 256)\n");
+    printf("  -X, --stripe_dirs DIR,DIR... Stripe the plot's buckets across 2, 4, 8 or 16 directories, one temporary and final file each; -g names the stripe manifest\n");
+    printf("  -A, --preallocate [true|false|contiguous] Reserve plot files on disk before writing them (default: true)\n");
+    printf("  -H, --hash_sort [true|false] Sort each bucket's nonces by hash when finalizing, so lookups binary-search them (default: false)\n");
+    printf("  -T, --transpose_bench [true|false] Time the shuffle's transpose kernels on one group of the planned shuffle and exit (default: false)\n");
     printf("  -h, --help                   Display this help message\n");
     printf("\nExample:\n");
     printf("  %s -a task -t 8 -K 20 -m 1024 -f output.dat\n", prog_name);
@@ -125,334 +509,2308 @@ void generateBlake3(uint8_t *record_hash, MemoRecord *record, unsigned long long
     // Store seed into the nonce
     memcpy(record->nonce, &seed, NONCE_SIZE);
 
-    // Generate Blake3 hash
-    blake3_hasher hasher;
-    blake3_hasher_init(&hasher);
-    blake3_hasher_update(&hasher, record->nonce, NONCE_SIZE);
-    blake3_hasher_finalize(&hasher, record_hash, HASH_SIZE);
+    // Generate Blake3 hash (a nonce always fits in a single block)
+    blake3_hash_nonce(record->nonce, NONCE_SIZE, record_hash, HASH_SIZE);
 }
 
-// Function to write a bucket of records to disk sequentially
-size_t writeBucketToDiskSequential(const Bucket *bucket, FILE *fd)
+// Function to allocate a zeroed arena of at least size bytes, backed by huge pages when possible
+void *allocate_arena(size_t size, size_t *arena_size, bool *huge_pages)
 {
-    // printf("num_records_in_bucket=%llu sizeof(MemoRecord)=%d\n",num_records_in_bucket,sizeof(MemoRecord));
-    size_t elementsWritten = fwrite(bucket->records, sizeof(MemoRecord), num_records_in_bucket, fd);
-    if (elementsWritten != num_records_in_bucket)
+    size_t aligned_size = (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+
+#ifdef MAP_HUGETLB
+    // Explicit huge pages, only available if the administrator reserved them
+    void *arena = mmap(NULL, aligned_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (arena != MAP_FAILED)
     {
-        fprintf(stderr, "Error writing bucket to file; elements written %zu when expected %llu\n",
-                elementsWritten, num_records_in_bucket);
-        fclose(fd);
-        exit(EXIT_FAILURE);
+        *arena_size = aligned_size;
+        *huge_pages = true;
+        return arena;
     }
-    return elementsWritten * sizeof(MemoRecord);
-}
+#endif
 
-// Function to insert a record into a bucket
-void insert_record(Bucket *buckets, MemoRecord *record, size_t bucketIndex)
-{
-    if (bucketIndex >= num_buckets)
+    // Fall back to regular pages, over-allocating so the arena can start on a
+    // huge page boundary and transparent huge pages can back all of it
+    size_t mapped_size = aligned_size + HUGE_PAGE_SIZE;
+    uint8_t *mapping = (uint8_t *)mmap(NULL, mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED)
     {
-        fprintf(stderr, "Error: Bucket index %zu out of range (0 to %llu).\n", bucketIndex, num_buckets - 1);
-        return;
+        return NULL;
     }
 
-    Bucket *bucket = &buckets[bucketIndex];
-
-    // Protect count increment with atomic operation
-    size_t idx;
-#pragma omp atomic capture
-    idx = bucket->count++;
-
-    // Check if there's room in the bucket
-    if (idx < num_records_in_bucket)
+    uint8_t *aligned = (uint8_t *)(((uintptr_t)mapping + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+    size_t head = aligned - mapping;
+    size_t tail = mapped_size - head - aligned_size;
+    if (head > 0)
     {
-        memcpy(bucket->records[idx].nonce, record->nonce, NONCE_SIZE);
+        munmap(mapping, head);
     }
-    else
+    if (tail > 0)
     {
-        // Bucket is full; handle overflow if necessary
-        // For now, we ignore overflow
+        munmap(aligned + aligned_size, tail);
     }
+
+#ifdef MADV_HUGEPAGE
+    madvise(aligned, aligned_size, MADV_HUGEPAGE);
+#endif
+
+    *arena_size = aligned_size;
+    *huge_pages = false;
+    return aligned;
 }
 
-// Function to concatenate two strings and return the result
-char *concat_strings(const char *str1, const char *str2)
+// Function to allocate the bucket arena and bucket counts, with bucket_stride records per bucket
+bool allocate_bucket_table(BucketTable *table, size_t bucket_stride)
 {
-    // Check for NULL pointers
-    if (str1 == NULL || str2 == NULL)
+    table->records = (MemoRecord *)allocate_arena(num_buckets * bucket_stride * sizeof(MemoRecord), &table->arena_size, &table->huge_pages);
+    if (table->records == NULL)
     {
-        fprintf(stderr, "Error: NULL string passed to concat_strings.\n");
-        return NULL;
+        return false;
     }
+    table->bucket_stride = bucket_stride;
+    table->slice_offset = 0;
 
-    // Calculate the lengths of the input strings
-    size_t len1 = strlen(str1);
-    size_t len2 = strlen(str2);
-
-    // Allocate memory for the concatenated string (+1 for the null terminator)
-    char *result = (char *)malloc(len1 + len2 + 1);
-    if (result == NULL)
+    table->counts = (bucket_count_t *)calloc(num_buckets, sizeof(bucket_count_t));
+    if (table->counts == NULL)
     {
-        fprintf(stderr, "Error: Memory allocation failed in concat_strings.\n");
-        return NULL;
+        munmap(table->records, table->arena_size);
+        return false;
     }
 
-    // Copy the first string into the result
-    strcpy(result, str1);
-
-    // Append the second string to the result
-    strcat(result, str2);
-
-    return result;
+    for (int p = 0; p < STAGING_PARTITIONS; p++)
+    {
+        omp_init_lock(&table->locks[p]);
+    }
+    return true;
 }
 
-// Function to check if a nonce is non-zero
-bool is_nonce_nonzero(const uint8_t *nonce, size_t nonce_size)
+// Function to free the bucket arena with a single munmap
+void free_bucket_table(BucketTable *table)
 {
-    // Check for NULL pointer
-    if (nonce == NULL)
-    {
-        // Handle error as needed
-        return false;
-    }
+    munmap(table->records, table->arena_size);
+    free(table->counts);
 
-    // Iterate over each byte of the nonce
-    for (size_t i = 0; i < nonce_size; ++i)
+    for (int p = 0; p < STAGING_PARTITIONS; p++)
     {
-        if (nonce[i] != 0)
-        {
-            // Found a non-zero byte
-            return true;
-        }
+        omp_destroy_lock(&table->locks[p]);
     }
-
-    // All bytes are zero
-    return false;
 }
 
-// Function to count zero-value MemoRecords in a binary file
-size_t count_zero_memo_records(const char *filename)
+// Function to get the records of a bucket from its index
+MemoRecord *bucket_records(const BucketTable *table, size_t bucketIndex)
 {
-    const size_t BATCH_SIZE = 1000000; // 1 million MemoRecords per batch
-    MemoRecord *buffer = NULL;
-    size_t total_zero_records = 0;
-    size_t total_nonzero_records = 0;
-    size_t records_read;
-    FILE *file = NULL;
+    return &table->records[bucketIndex * table->bucket_stride + table->slice_offset];
+}
 
-    // Open the file for reading in binary mode
-    file = fopen(filename, "rb");
-    if (file == NULL)
+// Function to open the temporary file, bypassing the page cache if requested
+int open_temp_file(const char *filename, bool direct)
+{
+    int flags = O_RDWR | O_CREAT | O_TRUNC;
+#ifdef O_DIRECT
+    if (direct)
     {
+        flags |= O_DIRECT;
+    }
+#endif
 
-        printf("Error opening file %s (#1)\n", filename);
-        return 0;
+    int fd = open(filename, flags, 0644);
+#ifdef O_DIRECT
+    if (fd < 0 && direct && errno == EINVAL)
+    {
+        // The file system does not support O_DIRECT (e.g. tmpfs)
+        fprintf(stderr, "Warning: O_DIRECT not supported for %s, using buffered I/O\n", filename);
+        DIRECT_IO = false;
+        fd = open(filename, flags & ~O_DIRECT, 0644);
+    }
+#endif
+#ifdef F_NOCACHE
+    if (fd >= 0 && direct)
+    {
+        fcntl(fd, F_NOCACHE, 1);
     }
+#endif
+    return fd;
+}
 
-    // Allocate memory for the batch of MemoRecords
-    buffer = (MemoRecord *)malloc(BATCH_SIZE * sizeof(MemoRecord));
-    if (buffer == NULL)
+// Function to reserve size bytes for a file before it is written, so the file system can
+// lay it out in few extents instead of growing it write by write; file systems that
+// cannot preallocate are left to grow the file, running out of space is fatal
+void preallocate_file(int fd, off_t size, const char *filename)
+{
+    if (PREALLOCATE == PREALLOCATE_OFF || size == 0)
     {
-        fprintf(stderr, "Error: Unable to allocate memory.\n");
-        fclose(file);
-        return 0;
+        return;
     }
 
-    // Read the file in batches
-    while ((records_read = fread(buffer, sizeof(MemoRecord), BATCH_SIZE, file)) > 0)
+#if defined(__APPLE__)
+    fstore_t store = {F_ALLOCATECONTIG | F_ALLOCATEALL, F_PEOFPOSMODE, 0, size, 0};
+    if (PREALLOCATE != PREALLOCATE_CONTIGUOUS || fcntl(fd, F_PREALLOCATE, &store) == -1)
     {
-        // Process each MemoRecord in the batch
-        for (size_t i = 0; i < records_read; ++i)
+        if (PREALLOCATE == PREALLOCATE_CONTIGUOUS)
         {
-            // Check if the MemoRecord's nonce is all zeros
-            if (is_nonce_nonzero(buffer[i].nonce, NONCE_SIZE))
-            {
-                ++total_nonzero_records;
-            }
-            else
-            {
-                ++total_zero_records;
-            }
+            fprintf(stderr, "Warning: no contiguous extent of %lld bytes for %s\n", (long long)size, filename);
+        }
+        store.fst_flags = F_ALLOCATEALL;
+        if (fcntl(fd, F_PREALLOCATE, &store) == -1)
+        {
+            return;
         }
     }
-
-    // Check for reading errors
-    if (ferror(file))
+    if (ftruncate(fd, size) != 0)
     {
-        perror("Error reading file");
+        perror("Error preallocating file");
+        exit(EXIT_FAILURE);
     }
-
-    // Clean up
-    fclose(file);
-    free(buffer);
-
-    // Print the total number of zero-value MemoRecords
-    printf("total_zero_records=%zu total_nonzero_records=%zu efficiency=%.2f%%\n", total_zero_records, total_nonzero_records, total_nonzero_records * 100.0 / (total_zero_records + total_nonzero_records));
-
-    return total_zero_records;
+#else
+    // On Linux, one fallocate call for the whole file is how extent based file
+    // systems are asked for the longest extents they can give
+#if defined(__linux__)
+    int result = fallocate(fd, 0, 0, size) == 0 ? 0 : errno;
+#else
+    int result = posix_fallocate(fd, 0, size);
+#endif
+    if (result == EOPNOTSUPP || result == EINVAL)
+    {
+        return;
+    }
+    if (result != 0)
+    {
+        fprintf(stderr, "Error preallocating %lld bytes for %s: %s\n", (long long)size, filename, strerror(result));
+        exit(EXIT_FAILURE);
+    }
+#endif
 }
 
-long get_file_size(const char *filename)
+// Function to pass an access pattern hint for a range of a file to the kernel
+void advise_file(int fd, off_t offset, off_t size, int advice)
 {
-    FILE *file = fopen(filename, "rb"); // Open the file in binary mode
-    long size;
+#ifdef POSIX_FADV_NORMAL
+    posix_fadvise(fd, offset, size, advice);
+#else
+    (void)fd;
+    (void)offset;
+    (void)size;
+    (void)advice;
+#endif
+}
 
-    if (file == NULL)
+// Function to count the extents a file is stored in; returns -1 if unknown
+long count_file_extents(int fd)
+{
+#if defined(__linux__) && defined(FS_IOC_FIEMAP)
+    // With no room for extents, FIEMAP only reports how many there are
+    struct fiemap map;
+    memset(&map, 0, sizeof(map));
+    map.fm_start = 0;
+    map.fm_length = FIEMAP_MAX_OFFSET;
+    map.fm_flags = FIEMAP_FLAG_SYNC;
+    map.fm_extent_count = 0;
+    if (ioctl(fd, FS_IOC_FIEMAP, &map) != 0)
     {
-        printf("Error opening file %s (#2)\n", filename);
-
-        perror("Error opening file");
         return -1;
     }
+    return map.fm_mapped_extents;
+#else
+    (void)fd;
+    return -1;
+#endif
+}
 
-    // Move the file pointer to the end of the file
-    if (fseek(file, 0, SEEK_END) != 0)
+// Function to set up a writeback governor for fd; a file opened with O_DIRECT
+// has no dirty pages to govern
+void writeback_init(WritebackGovernor *wb, int fd)
+{
+    wb->fd = fd;
+    wb->limit = WRITEBACK_LIMIT_MB * 1024 * 1024;
+    wb->pending = 0;
+    wb->head = 0;
+    wb->count = 0;
+    wb->wait_time = 0.0;
+#ifdef O_DIRECT
+    int flags = fcntl(fd, F_GETFL);
+    if (flags != -1 && (flags & O_DIRECT))
     {
-        perror("Error seeking to end of file");
-        fclose(file);
-        return -1;
+        wb->limit = 0;
     }
+#endif
+#ifndef SYNC_FILE_RANGE_WRITE
+    wb->limit = 0;
+#endif
+    pthread_mutex_init(&wb->mutex, NULL);
+}
 
-    // Get the current position in the file, which is the size
-    size = ftell(file);
-    if (size == -1L)
+// Function to wait until the oldest range under writeback is on the device; the caller holds the mutex
+void writeback_wait_oldest(WritebackGovernor *wb)
+{
+#ifdef SYNC_FILE_RANGE_WRITE
+    double start_time = omp_get_wtime();
+    if (sync_file_range(wb->fd, wb->offsets[wb->head], wb->lengths[wb->head],
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER) != 0)
     {
-        perror("Error getting file position");
-        fclose(file);
-        return -1;
+        perror("Error waiting for writeback");
+        exit(EXIT_FAILURE);
     }
-
-    fclose(file);
-    return size;
+    wb->wait_time += omp_get_wtime() - start_time;
+#endif
+    wb->pending -= wb->lengths[wb->head];
+    wb->head = (wb->head + 1) % WRITEBACK_MAX_RANGES;
+    wb->count--;
 }
 
-size_t process_memo_records(const char *filename, const size_t BATCH_SIZE)
+// Function to start writeback of a range that was just written, first waiting
+// for older ranges until the new one fits under the limit
+void writeback_range(WritebackGovernor *wb, off_t offset, off_t size)
 {
-    // const size_t BATCH_SIZE = 1000000; // 1 million MemoRecords per batch
-    MemoRecord *buffer = NULL;
-    size_t total_records = 0;
-    size_t zero_nonce_count = 0;
-    size_t records_read;
-    FILE *file = NULL;
-    uint8_t prev_hash[PREFIX_SIZE] = {0}; // Initialize previous hash prefix to zero
-    uint8_t prev_nonce[NONCE_SIZE] = {0}; // Initialize previous nonce to zero
-    size_t count_condition_met = 0;       // Counter for records meeting the condition
-    size_t count_condition_not_met = 0;
-
-    long filesize = get_file_size(filename);
-
-    if (filesize != -1)
+    if (wb->limit == 0 || size <= 0)
     {
-        if (!BENCHMARK)
-            printf("Size of '%s' is %ld bytes.\n", filename, filesize);
+        return;
     }
 
-    // Open the file for reading in binary mode
-    file = fopen(filename, "rb");
-    if (file == NULL)
+#ifdef SYNC_FILE_RANGE_WRITE
+    pthread_mutex_lock(&wb->mutex);
+    if (sync_file_range(wb->fd, offset, size, SYNC_FILE_RANGE_WRITE) != 0)
     {
-        printf("Error opening file %s (#3)\n", filename);
-
-        perror("Error opening file");
-        return 0;
+        perror("Error starting writeback");
+        exit(EXIT_FAILURE);
+    }
+    while (wb->count > 0 && (wb->count == WRITEBACK_MAX_RANGES || wb->pending + size > wb->limit))
+    {
+        writeback_wait_oldest(wb);
     }
+    unsigned tail = (wb->head + wb->count) % WRITEBACK_MAX_RANGES;
+    wb->offsets[tail] = offset;
+    wb->lengths[tail] = size;
+    wb->pending += size;
+    wb->count++;
+    pthread_mutex_unlock(&wb->mutex);
+#endif
+}
 
-    // Allocate memory for the batch of MemoRecords
-    buffer = (MemoRecord *)malloc(BATCH_SIZE * sizeof(MemoRecord));
-    if (buffer == NULL)
+// Function to wait for every range still under writeback and release the governor
+void writeback_finish(WritebackGovernor *wb)
+{
+    while (wb->count > 0)
     {
-        fprintf(stderr, "Error: Unable to allocate memory.\n");
-        fclose(file);
-        return 0;
+        writeback_wait_oldest(wb);
     }
+    pthread_mutex_destroy(&wb->mutex);
+}
 
-    // Start walltime measurement
-    double start_time = omp_get_wtime();
-    // double end_time = omp_get_wtime();
+// Function to make a file's data durable; on Linux the metadata that is not
+// needed to read the data back (such as the modification time) is skipped
+int sync_file_data(int fd)
+{
+#ifdef __linux__
+    return fdatasync(fd);
+#else
+    return fsync(fd);
+#endif
+}
+
+// Function to write a buffer to a file at the given offset in chunks of at most IO_CHUNK_SIZE
+void pwrite_fully(int fd, const void *buffer, size_t size, off_t offset)
+{
+    const uint8_t *data = (const uint8_t *)buffer;
+
+    while (size > 0)
+    {
+        size_t chunk = size < IO_CHUNK_SIZE ? size : IO_CHUNK_SIZE;
+        ssize_t written = pwrite(fd, data, chunk, offset);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("Error writing to file");
+            exit(EXIT_FAILURE);
+        }
+        if (written == 0)
+        {
+            fprintf(stderr, "Error writing to file, no progress at offset %lld\n", (long long)offset);
+            exit(EXIT_FAILURE);
+        }
+        data += written;
+        offset += written;
+        size -= written;
+    }
+}
+
+// Function to read a buffer from a file at the given offset in chunks of at most IO_CHUNK_SIZE
+void pread_fully(int fd, void *buffer, size_t size, off_t offset)
+{
+    uint8_t *data = (uint8_t *)buffer;
+
+    while (size > 0)
+    {
+        size_t chunk = size < IO_CHUNK_SIZE ? size : IO_CHUNK_SIZE;
+        ssize_t bytesRead = pread(fd, data, chunk, offset);
+        if (bytesRead < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("Error reading file");
+            exit(EXIT_FAILURE);
+        }
+        if (bytesRead == 0)
+        {
+            fprintf(stderr, "Error reading file, unexpected end of file at offset %lld\n", (long long)offset);
+            exit(EXIT_FAILURE);
+        }
+        data += bytesRead;
+        offset += bytesRead;
+        size -= bytesRead;
+    }
+}
+
+// Function to parse the name of an I/O backend
+bool parse_io_backend(const char *name, IoBackendKind *kind)
+{
+    if (strcmp(name, "sync") == 0)
+    {
+        *kind = IO_BACKEND_SYNC;
+        return true;
+    }
+    if (strcmp(name, "io_uring") == 0)
+    {
+        *kind = IO_BACKEND_URING;
+        return true;
+    }
+    return false;
+}
+
+// Function to get the name of an I/O backend
+const char *io_backend_name(IoBackendKind kind)
+{
+    return kind == IO_BACKEND_URING ? "io_uring" : "sync";
+}
+
+// Function to parse a lookup mode name; returns false if it is not one
+bool parse_lookup_mode(const char *name, LookupMode *mode)
+{
+    if (strcmp(name, "read") == 0)
+    {
+        *mode = LOOKUP_READ;
+        return true;
+    }
+    if (strcmp(name, "mmap") == 0)
+    {
+        *mode = LOOKUP_MMAP;
+        return true;
+    }
+    if (strcmp(name, "mmap_willneed") == 0)
+    {
+        *mode = LOOKUP_MMAP_WILLNEED;
+        return true;
+    }
+    return false;
+}
+
+// Function to get the name of a lookup mode
+const char *lookup_mode_name(LookupMode mode)
+{
+    return mode == LOOKUP_MMAP_WILLNEED ? "mmap_willneed" : (mode == LOOKUP_MMAP ? "mmap" : "read");
+}
+
+// Function to remember the tag of a finished request until io_queue_wait returns it
+void io_queue_complete(IoQueue *q, uint64_t tag)
+{
+    if (q->num_completed == q->completed_capacity)
+    {
+        size_t capacity = q->completed_capacity * 2;
+        uint64_t *completed = (uint64_t *)realloc(q->completed, capacity * sizeof(uint64_t));
+        if (completed == NULL)
+        {
+            fprintf(stderr, "Error: Unable to allocate memory for I/O completions.\n");
+            exit(EXIT_FAILURE);
+        }
+        q->completed = completed;
+        q->completed_capacity = capacity;
+    }
+    q->completed[q->num_completed++] = tag;
+}
+
+#ifdef HAVE_IO_URING
+// Function to enter the ring, retrying if interrupted by a signal
+int uring_enter(IoQueue *q, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    int ret;
+    do
+    {
+        ret = (int)syscall(__NR_io_uring_enter, q->ring_fd, to_submit, min_complete, flags, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+    return ret;
+}
+
+// Function to set up an io_uring with queue_depth submission entries
+bool uring_setup(IoQueue *q)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    q->ring_fd = (int)syscall(__NR_io_uring_setup, q->queue_depth, &params);
+    if (q->ring_fd < 0)
+    {
+        return false;
+    }
+
+    // IORING_OP_READ and IORING_OP_WRITE arrived in Linux 5.6 along with this
+    // feature bit; older kernels set up the ring but fail every request
+    if (!(params.features & IORING_FEAT_RW_CUR_POS))
+    {
+        close(q->ring_fd);
+        errno = EOPNOTSUPP;
+        return false;
+    }
+
+    q->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    q->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (q->cq_ring_size > q->sq_ring_size)
+        {
+            q->sq_ring_size = q->cq_ring_size;
+        }
+        q->cq_ring_size = q->sq_ring_size;
+    }
+
+    q->sq_ring = mmap(NULL, q->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, q->ring_fd, IORING_OFF_SQ_RING);
+    if (q->sq_ring == MAP_FAILED)
+    {
+        close(q->ring_fd);
+        return false;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        q->cq_ring = q->sq_ring;
+    }
+    else
+    {
+        q->cq_ring = mmap(NULL, q->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, q->ring_fd, IORING_OFF_CQ_RING);
+        if (q->cq_ring == MAP_FAILED)
+        {
+            munmap(q->sq_ring, q->sq_ring_size);
+            close(q->ring_fd);
+            return false;
+        }
+    }
+
+    q->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    q->sqes = (struct io_uring_sqe *)mmap(NULL, q->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, q->ring_fd, IORING_OFF_SQES);
+    if (q->sqes == MAP_FAILED)
+    {
+        if (q->cq_ring != q->sq_ring)
+        {
+            munmap(q->cq_ring, q->cq_ring_size);
+        }
+        munmap(q->sq_ring, q->sq_ring_size);
+        close(q->ring_fd);
+        return false;
+    }
+
+    uint8_t *sq = (uint8_t *)q->sq_ring;
+    uint8_t *cq = (uint8_t *)q->cq_ring;
+    q->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    q->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    q->sq_array = (unsigned *)(sq + params.sq_off.array);
+    q->cq_head = (unsigned *)(cq + params.cq_off.head);
+    q->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    q->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    q->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return true;
+}
+
+// Function to submit a request, or what is left of it after a short transfer
+void uring_push(IoQueue *q, unsigned slot)
+{
+    IoRequest *req = &q->requests[slot];
+    unsigned tail = *q->sq_tail;
+    unsigned index = tail & *q->sq_mask;
+
+    struct io_uring_sqe *sqe = &q->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = req->write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = req->fd;
+    sqe->addr = (uint64_t)(uintptr_t)req->buf;
+    sqe->len = (uint32_t)req->len;
+    sqe->off = (uint64_t)req->offset;
+    sqe->user_data = slot;
+
+    q->sq_array[index] = index;
+    __atomic_store_n(q->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    if (uring_enter(q, 1, 0, 0) < 0)
+    {
+        perror("Error submitting I/O request");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Function to reap one finished request, resubmitting the rest of short transfers
+void uring_reap(IoQueue *q)
+{
+    for (;;)
+    {
+        unsigned head = *q->cq_head;
+        if (head == __atomic_load_n(q->cq_tail, __ATOMIC_ACQUIRE))
+        {
+            if (uring_enter(q, 0, 1, IORING_ENTER_GETEVENTS) < 0)
+            {
+                perror("Error waiting for I/O completion");
+                exit(EXIT_FAILURE);
+            }
+            continue;
+        }
+
+        struct io_uring_cqe *cqe = &q->cqes[head & *q->cq_mask];
+        unsigned slot = (unsigned)cqe->user_data;
+        int res = cqe->res;
+        __atomic_store_n(q->cq_head, head + 1, __ATOMIC_RELEASE);
+
+        IoRequest *req = &q->requests[slot];
+        if (res == -EINTR || res == -EAGAIN)
+        {
+            uring_push(q, slot);
+            continue;
+        }
+        if (res < 0)
+        {
+            errno = -res;
+            perror(req->write ? "Error writing to file" : "Error reading file");
+            exit(EXIT_FAILURE);
+        }
+        if (res == 0)
+        {
+            fprintf(stderr, "Error %s file, no progress at offset %lld\n", req->write ? "writing to" : "reading", (long long)req->offset);
+            exit(EXIT_FAILURE);
+        }
+
+        req->buf += res;
+        req->offset += res;
+        req->len -= res;
+        if (req->len > 0)
+        {
+            uring_push(q, slot);
+            continue;
+        }
+
+        req->busy = false;
+        q->in_flight--;
+        io_queue_complete(q, req->tag);
+        return;
+    }
+}
+#endif
+
+// Function to set up an I/O queue, falling back to the sync backend if io_uring is unavailable
+bool io_queue_init(IoQueue *q, IoBackendKind kind, unsigned queue_depth)
+{
+    memset(q, 0, sizeof(*q));
+    q->kind = kind;
+    q->queue_depth = queue_depth;
+
+    q->completed_capacity = queue_depth * 2;
+    q->completed = (uint64_t *)malloc(q->completed_capacity * sizeof(uint64_t));
+    q->requests = (IoRequest *)calloc(queue_depth, sizeof(IoRequest));
+    if (q->completed == NULL || q->requests == NULL)
+    {
+        free(q->completed);
+        free(q->requests);
+        return false;
+    }
+
+    // Every queue falls back the same way, so the warning is printed once per process
+    static bool fallback_warned = false;
+    if (kind == IO_BACKEND_URING)
+    {
+#ifdef HAVE_IO_URING
+        if (!uring_setup(q))
+        {
+            if (!__atomic_exchange_n(&fallback_warned, true, __ATOMIC_RELAXED))
+            {
+                perror("Warning: io_uring setup failed, using sync I/O");
+            }
+            q->kind = IO_BACKEND_SYNC;
+        }
+#else
+        if (!__atomic_exchange_n(&fallback_warned, true, __ATOMIC_RELAXED))
+        {
+            fprintf(stderr, "Warning: io_uring is not available on this platform, using sync I/O\n");
+        }
+        q->kind = IO_BACKEND_SYNC;
+#endif
+    }
+    return true;
+}
+
+// Function to wait for every request still in flight
+void io_queue_drain(IoQueue *q)
+{
+#ifdef HAVE_IO_URING
+    while (q->in_flight > 0)
+    {
+        uring_reap(q);
+    }
+#endif
+    q->num_completed = 0;
+}
+
+// Function to tear down an I/O queue, waiting for requests still in flight
+void io_queue_free(IoQueue *q)
+{
+    io_queue_drain(q);
+#ifdef HAVE_IO_URING
+    if (q->kind == IO_BACKEND_URING)
+    {
+        munmap(q->sqes, q->sqes_size);
+        if (q->cq_ring != q->sq_ring)
+        {
+            munmap(q->cq_ring, q->cq_ring_size);
+        }
+        munmap(q->sq_ring, q->sq_ring_size);
+        close(q->ring_fd);
+    }
+#endif
+    free(q->requests);
+    free(q->completed);
+}
+
+// Function to queue a read or write; blocks while queue_depth requests are in flight
+void io_queue_submit(IoQueue *q, int fd, uint8_t *buffer, size_t size, off_t offset, bool write, uint64_t tag)
+{
+    if (q->kind == IO_BACKEND_SYNC)
+    {
+        if (write)
+        {
+            pwrite_fully(fd, buffer, size, offset);
+        }
+        else
+        {
+            pread_fully(fd, buffer, size, offset);
+        }
+        io_queue_complete(q, tag);
+        return;
+    }
+
+#ifdef HAVE_IO_URING
+    while (q->in_flight == q->queue_depth)
+    {
+        uring_reap(q);
+    }
+
+    unsigned slot = 0;
+    while (q->requests[slot].busy)
+    {
+        slot++;
+    }
+
+    IoRequest *req = &q->requests[slot];
+    req->fd = fd;
+    req->buf = buffer;
+    req->len = size;
+    req->offset = offset;
+    req->write = write;
+    req->tag = tag;
+    req->busy = true;
+    q->in_flight++;
+    uring_push(q, slot);
+#endif
+}
+
+// Function to read contiguous file data into a scatter list, IOV_MAX entries per call
+void preadv_fully(int fd, struct iovec *iov, int iovcnt, off_t offset)
+{
+    while (iovcnt > 0)
+    {
+        int count = iovcnt < IOV_MAX ? iovcnt : IOV_MAX;
+        ssize_t bytesRead = preadv(fd, iov, count, offset);
+        if (bytesRead < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("Error reading file");
+            exit(EXIT_FAILURE);
+        }
+        if (bytesRead == 0)
+        {
+            fprintf(stderr, "Error reading file, unexpected end of file at offset %lld\n", (long long)offset);
+            exit(EXIT_FAILURE);
+        }
+        offset += bytesRead;
+
+        // Skip the entries that were filled and trim a partially filled one
+        while (iovcnt > 0 && (size_t)bytesRead >= iov->iov_len)
+        {
+            bytesRead -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (bytesRead > 0)
+        {
+            iov->iov_base = (uint8_t *)iov->iov_base + bytesRead;
+            iov->iov_len -= bytesRead;
+        }
+    }
+}
+
+// Function to split a transfer into IO_CHUNK_SIZE requests so that several can be in flight;
+// returns the number of completions with this tag that io_queue_wait will report
+unsigned long long io_queue_transfer(IoQueue *q, int fd, uint8_t *buffer, size_t size, off_t offset, bool write, uint64_t tag)
+{
+    unsigned long long num_requests = 0;
+    while (size > 0)
+    {
+        size_t chunk = size < IO_CHUNK_SIZE ? size : IO_CHUNK_SIZE;
+        io_queue_submit(q, fd, buffer, chunk, offset, write, tag);
+        buffer += chunk;
+        offset += chunk;
+        size -= chunk;
+        num_requests++;
+    }
+    return num_requests;
+}
+
+// Function to queue a read of size bytes at offset into buffer
+unsigned long long io_queue_read(IoQueue *q, int fd, void *buffer, size_t size, off_t offset, uint64_t tag)
+{
+    return io_queue_transfer(q, fd, (uint8_t *)buffer, size, offset, false, tag);
+}
+
+// Function to queue a write of size bytes from buffer at offset
+unsigned long long io_queue_write(IoQueue *q, int fd, const void *buffer, size_t size, off_t offset, uint64_t tag)
+{
+    return io_queue_transfer(q, fd, (uint8_t *)buffer, size, offset, true, tag);
+}
+
+// Function to wait for the next finished request; returns false if none is outstanding
+bool io_queue_wait(IoQueue *q, uint64_t *tag)
+{
+#ifdef HAVE_IO_URING
+    if (q->num_completed == 0 && q->in_flight > 0)
+    {
+        uring_reap(q);
+    }
+#endif
+    if (q->num_completed == 0)
+    {
+        return false;
+    }
+
+    // Return tags in completion order
+    *tag = q->completed[0];
+    q->num_completed--;
+    memmove(q->completed, q->completed + 1, q->num_completed * sizeof(uint64_t));
+    return true;
+}
+
+// Function to get the file offset of a slice of a bucket in a plot file
+off_t plot_slice_offset(const PlotLayout *layout, unsigned long long bucketIndex, unsigned long long slice)
+{
+    unsigned long long group = bucketIndex / layout->group_buckets;
+    unsigned long long position = (group * layout->slices + slice) * layout->group_buckets + bucketIndex % layout->group_buckets;
+    return position * layout->records_in_slice * sizeof(MemoRecord);
+}
+
+// Function to get the file offset and size of the chunk that starts position bytes into
+// a round; chunks are at most IO_CHUNK_SIZE and never cross the end of a run
+off_t round_chunk_offset(const PlotLayout *layout, unsigned long long round, size_t round_bytes, size_t run_bytes, size_t position, size_t *chunk)
+{
+    size_t run_left = run_bytes - position % run_bytes;
+    *chunk = run_left < IO_CHUNK_SIZE ? run_left : IO_CHUNK_SIZE;
+    if (layout == NULL)
+    {
+        return round * round_bytes + position;
+    }
+    return plot_slice_offset(layout, position / run_bytes * layout->group_buckets, round) + position % run_bytes;
+}
+
+// Function to write the stripe_buckets buckets of a round starting at first_bucket, either
+// to their slot in the (stripe's) temporary file or, given a final layout, straight
+// to the round's slice of every group
+size_t write_round(const BucketTable *table, IoQueue *io, WritebackGovernor *wb, int fd, unsigned long long round, const PlotLayout *layout,
+                   unsigned long long first_bucket, unsigned long long stripe_buckets)
+{
+    // The arena holds the buckets back to back in bucket order, which is exactly
+    // the round's slot in the file; it is huge page aligned and its size is a
+    // multiple of num_buckets, so it also meets O_DIRECT's alignment rules
+    size_t round_bytes = stripe_buckets * num_records_in_bucket * sizeof(MemoRecord);
+    const uint8_t *records = (const uint8_t *)table->records + first_bucket * num_records_in_bucket * sizeof(MemoRecord);
+
+    // A run is what is contiguous in the file: the whole round, or a group's slice of it
+    size_t run_bytes = layout == NULL ? round_bytes : layout->group_buckets * num_records_in_bucket * sizeof(MemoRecord);
+    unsigned max_in_flight = io->kind == IO_BACKEND_SYNC ? 1 : io->queue_depth;
+
+    // Chunks are tagged with their position in the round, and each one is handed
+    // to the device as soon as it completes instead of leaving it dirty in the
+    // page cache until the whole round is written
+    size_t next = 0;
+    unsigned in_flight = 0;
+    while (next < round_bytes || in_flight > 0)
+    {
+        while (in_flight < max_in_flight && next < round_bytes)
+        {
+            size_t chunk;
+            off_t offset = round_chunk_offset(layout, round, round_bytes, run_bytes, next, &chunk);
+            io_queue_write(io, fd, records + next, chunk, offset, next);
+            next += chunk;
+            in_flight++;
+        }
+
+        uint64_t tag;
+        if (!io_queue_wait(io, &tag))
+        {
+            fprintf(stderr, "Error: round %llu writes lost track of %u chunks in flight.\n", round, in_flight);
+            exit(EXIT_FAILURE);
+        }
+        in_flight--;
+
+        size_t chunk;
+        off_t offset = round_chunk_offset(layout, round, round_bytes, run_bytes, tag, &chunk);
+        writeback_range(wb, offset, chunk);
+    }
+
+    return round_bytes;
+}
+
+// Function run by the writer thread to drain one round's bucket table
+void *round_writer(void *arg)
+{
+    RoundWrite *job = (RoundWrite *)arg;
+
+    job->start_time = omp_get_wtime();
+    write_round(job->table, job->io, job->writeback, job->fd, job->round, job->layout, job->first_bucket, job->stripe_buckets);
+    job->end_time = omp_get_wtime();
+    return NULL;
+}
+
+// Function to start one writer thread per stripe, each draining its stripe of a round's table
+void start_round_writers(RoundWrite *jobs, pthread_t *writers, int num_stripes, const BucketTable *table, unsigned long long round)
+{
+    for (int k = 0; k < num_stripes; k++)
+    {
+        jobs[k].table = table;
+        jobs[k].round = round;
+        if (pthread_create(&writers[k], NULL, round_writer, &jobs[k]) != 0)
+        {
+            perror("Error creating writer thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+// Function to wait for every stripe's writer thread; start_time and end_time span all of their writes
+void join_round_writers(RoundWrite *jobs, pthread_t *writers, int num_stripes, double *start_time, double *end_time)
+{
+    for (int k = 0; k < num_stripes; k++)
+    {
+        pthread_join(writers[k], NULL);
+        if (k == 0 || jobs[k].start_time < *start_time)
+            *start_time = jobs[k].start_time;
+        if (k == 0 || jobs[k].end_time > *end_time)
+            *end_time = jobs[k].end_time;
+    }
+}
+
+// Function to allocate one staging buffer per thread
+StagingBuffer **allocate_staging(int num_staging)
+{
+    StagingBuffer **staging = (StagingBuffer **)calloc(num_staging, sizeof(StagingBuffer *));
+    if (staging == NULL)
+    {
+        return NULL;
+    }
+
+    for (int t = 0; t < num_staging; t++)
+    {
+        staging[t] = (StagingBuffer *)aligned_alloc(64, sizeof(StagingBuffer));
+        if (staging[t] == NULL)
+        {
+            return NULL;
+        }
+        memset(staging[t]->fill, 0, sizeof(staging[t]->fill));
+    }
+    return staging;
+}
+
+// Function to free the per-thread staging buffers
+void free_staging(StagingBuffer **staging, int num_staging)
+{
+    for (int t = 0; t < num_staging; t++)
+    {
+        free(staging[t]);
+    }
+    free(staging);
+}
+
+// Function to copy a run of staged nonces of one partition into their buckets
+void flush_staging_run(BucketTable *table, uint32_t partition, const uint64_t *entries, size_t count)
+{
+    for (size_t k = 0; k < count; k++)
+    {
+        size_t bucketIndex = ((size_t)partition << STAGING_LOW_BITS) | (entries[k] & STAGING_LOW_MASK);
+        bucket_count_t idx = table->counts[bucketIndex];
+
+        // Check if there's room in the bucket; overflow records are ignored
+        if (idx < num_records_in_bucket)
+        {
+            unsigned long long nonce = entries[k] >> STAGING_LOW_BITS;
+            memcpy(bucket_records(table, bucketIndex)[idx].nonce, &nonce, NONCE_SIZE);
+            table->counts[bucketIndex] = idx + 1;
+        }
+    }
+}
+
+// Function to stage a nonce for its bucket, flushing the partition's run when it is full
+void stage_record(BucketTable *table, StagingBuffer *staging, unsigned long long nonce, uint32_t bucketIndex)
+{
+    uint32_t partition = bucketIndex >> STAGING_LOW_BITS;
+    uint16_t fill = staging->fill[partition];
+
+    staging->entries[partition][fill++] = ((uint64_t)nonce << STAGING_LOW_BITS) | (bucketIndex & STAGING_LOW_MASK);
+    if (fill == STAGING_ENTRIES)
+    {
+        omp_set_lock(&table->locks[partition]);
+        flush_staging_run(table, partition, staging->entries[partition], fill);
+        omp_unset_lock(&table->locks[partition]);
+        fill = 0;
+    }
+    staging->fill[partition] = fill;
+}
+
+// Function to flush what is left in every thread's staging buffer at the end of a round
+void flush_staging(BucketTable *table, StagingBuffer **staging, int num_staging)
+{
+    // Each partition is drained by a single thread, so no locks are needed
+#pragma omp parallel for schedule(dynamic)
+    for (int p = 0; p < STAGING_PARTITIONS; p++)
+    {
+        for (int t = 0; t < num_staging; t++)
+        {
+            flush_staging_run(table, p, staging[t]->entries[p], staging[t]->fill[p]);
+            staging[t]->fill[p] = 0;
+        }
+    }
+}
+
+// Function to zero the slots each bucket of a round's table was left short of; the
+// table is reused by later rounds, which must not write its old nonces again
+void clear_unfilled_slots(BucketTable *table)
+{
+#pragma omp parallel for schedule(static)
+    for (unsigned long long i = 0; i < num_buckets; i++)
+    {
+        bucket_count_t count = table->counts[i];
+        memset(&bucket_records(table, i)[count], 0, (num_records_in_bucket - count) * sizeof(MemoRecord));
+    }
+}
+
+// Function to hash the nonces in [batch_start, batch_end) and insert them into their buckets
+void hashgen_batch(BucketTable *table, StagingBuffer *staging, unsigned long long batch_start, unsigned long long batch_end)
+{
+    uint32_t bucket_indices[HASHGEN_LANES];
+
+    for (unsigned long long j = batch_start; j < batch_end; j += HASHGEN_LANES)
+    {
+        size_t count = HASHGEN_LANES;
+        if (batch_end - j < HASHGEN_LANES)
+        {
+            count = batch_end - j;
+        }
+
+        // Bucket indices of nonces j..j+count-1, straight from the SIMD generator
+        blake3_nonce_prefixes(j, count, NONCE_SIZE, PREFIX_SIZE, bucket_indices);
+        if (MEMORY_WRITE)
+        {
+            for (size_t k = 0; k < count; k++)
+            {
+                stage_record(table, staging, j + k, bucket_indices[k]);
+            }
+        }
+    }
+}
+
+// Function to transpose the slice of round r of a shuffle batch into its place in each bucket;
+// this is the reference loop that transpose_batch is checked and timed against
+void transpose_slice(MemoRecord *bufferShuffled, const MemoRecord *buffer, unsigned long long r, unsigned long long num_buckets_to_read)
+{
+#pragma omp parallel for schedule(static)
+    for (unsigned long long s = 0; s < num_buckets_to_read; s++)
+    {
+        off_t index_src = ((r * num_buckets_to_read + s) * num_records_in_bucket);
+        off_t index_dest = (s * rounds + r) * num_records_in_bucket;
+
+        memcpy(&bufferShuffled[index_dest], &buffer[index_src], num_records_in_bucket * sizeof(MemoRecord));
+    }
+}
+
+// Function to copy one run of records with 16-byte vector loads and stores
+void copy_run(uint8_t *dst, const uint8_t *src, size_t bytes)
+{
+#if defined(__SSE2__)
+    for (; bytes >= 16; bytes -= 16, dst += 16, src += 16)
+    {
+        _mm_storeu_si128((__m128i *)dst, _mm_loadu_si128((const __m128i *)src));
+    }
+#endif
+    memcpy(dst, src, bytes);
+}
+
+// Function to copy into memory that is only read again by the write to disk,
+// with non-temporal stores so the output does not evict the input from the cache
+void stream_copy(uint8_t *dst, const uint8_t *src, size_t bytes)
+{
+#if defined(__SSE2__)
+    // Non-temporal stores need a 16-byte aligned destination
+    size_t head = (16 - ((uintptr_t)dst & 15)) & 15;
+    if (head > bytes)
+    {
+        head = bytes;
+    }
+    memcpy(dst, src, head);
+    dst += head;
+    src += head;
+    bytes -= head;
+
+    for (; bytes >= 64; bytes -= 64, dst += 64, src += 64)
+    {
+        __m128i v0 = _mm_loadu_si128((const __m128i *)src);
+        __m128i v1 = _mm_loadu_si128((const __m128i *)(src + 16));
+        __m128i v2 = _mm_loadu_si128((const __m128i *)(src + 32));
+        __m128i v3 = _mm_loadu_si128((const __m128i *)(src + 48));
+        _mm_stream_si128((__m128i *)dst, v0);
+        _mm_stream_si128((__m128i *)(dst + 16), v1);
+        _mm_stream_si128((__m128i *)(dst + 32), v2);
+        _mm_stream_si128((__m128i *)(dst + 48), v3);
+    }
+    for (; bytes >= 16; bytes -= 16, dst += 16, src += 16)
+    {
+        _mm_stream_si128((__m128i *)dst, _mm_loadu_si128((const __m128i *)src));
+    }
+#endif
+    memcpy(dst, src, bytes);
+}
+
+// Function to transpose all slices of a shuffle batch at once. Buckets are
+// handled in tiles: each slice's runs for the tile are adjacent in the input and are
+// gathered into a cache resident tile, which is then streamed to the output, where the
+// tile's buckets are adjacent too, so both sides are accessed sequentially
+void transpose_batch(MemoRecord *bufferShuffled, const MemoRecord *buffer, unsigned long long num_buckets_to_read, unsigned long long slices, unsigned long long slice_records)
+{
+    size_t run_bytes = slice_records * sizeof(MemoRecord);
+    size_t bucket_bytes = run_bytes * slices;
+    unsigned long long tile_buckets = TRANSPOSE_TILE_BYTES / bucket_bytes;
+    if (tile_buckets == 0)
+    {
+        tile_buckets = 1;
+    }
+    unsigned long long num_tiles = (num_buckets_to_read + tile_buckets - 1) / tile_buckets;
+    size_t tile_size = (tile_buckets * bucket_bytes + 63) / 64 * 64;
+
+#pragma omp parallel
+    {
+        uint8_t *tile = (uint8_t *)aligned_alloc(64, tile_size);
+        if (tile == NULL)
+        {
+            fprintf(stderr, "Error: Unable to allocate memory for the transpose tile.\n");
+            exit(EXIT_FAILURE);
+        }
+
+#pragma omp for schedule(static)
+        for (unsigned long long t = 0; t < num_tiles; t++)
+        {
+            unsigned long long first = t * tile_buckets;
+            unsigned long long count = num_buckets_to_read - first < tile_buckets ? num_buckets_to_read - first : tile_buckets;
+
+            for (unsigned long long r = 0; r < slices; r++)
+            {
+                const uint8_t *src = (const uint8_t *)&buffer[(r * num_buckets_to_read + first) * slice_records];
+                for (unsigned long long s = 0; s < count; s++)
+                {
+                    copy_run(tile + s * bucket_bytes + r * run_bytes, src + s * run_bytes, run_bytes);
+                }
+            }
+
+            stream_copy((uint8_t *)bufferShuffled + first * bucket_bytes, tile, count * bucket_bytes);
+        }
+
+#if defined(__SSE2__)
+        // Make this thread's non-temporal stores visible before the output is handed on
+        _mm_sfence();
+#endif
+        free(tile);
+    }
+}
+
+uint64_t largest_power_of_two_less_than(uint64_t number)
+{
+    if (number == 0)
+    {
+        return 0;
+    }
+
+    // Decrement number to handle cases where number is already a power of 2
+    number--;
+
+    // Set all bits to the right of the most significant bit
+    number |= number >> 1;
+    number |= number >> 2;
+    number |= number >> 4;
+    number |= number >> 8;
+    number |= number >> 16;
+    number |= number >> 32; // Only needed for 64-bit integers
+
+    // The most significant bit is now set; shift right to get the largest power of 2 less than the original number
+    return (number + 1) >> 1;
+}
+
+// Function to get the number of buckets the shuffle handles per group; the pipeline
+// holds SHUFFLE_RING_SLOTS groups per ring, in an input and an output ring, or
+// only in the input ring when shuffling in place; a group's buffer holds
+// bucket_records records of each of its buckets, and groups evenly divide the
+// stripe_buckets buckets being shuffled
+unsigned long long shuffle_group_buckets(unsigned long long memory_bytes, unsigned long long bucket_records, unsigned long long stripe_buckets)
+{
+    unsigned long long num_buffers = SHUFFLE_IN_PLACE ? SHUFFLE_RING_SLOTS : 2 * SHUFFLE_RING_SLOTS;
+    unsigned long long num_buckets_to_read = ceil((memory_bytes / (bucket_records * NONCE_SIZE)) / num_buffers);
+    if (DEBUG)
+        printf("will read %llu buckets at one time, %llu bytes\n", num_buckets_to_read, bucket_records * NONCE_SIZE * num_buckets_to_read);
+    if (num_buckets_to_read > stripe_buckets)
+    {
+        num_buckets_to_read = stripe_buckets;
+    }
+    // need to fix this for 5 byte NONCE_SIZE
+    if (stripe_buckets % num_buckets_to_read != 0)
+    {
+        uint64_t ratio = stripe_buckets / num_buckets_to_read;
+        uint64_t result = largest_power_of_two_less_than(ratio);
+        if (DEBUG)
+            printf("Largest power of 2 less than %lu is %lu\n", ratio, result);
+        num_buckets_to_read = stripe_buckets / result;
+        if (DEBUG)
+            printf("will read %llu buckets at one time, %llu bytes\n", num_buckets_to_read, bucket_records * NONCE_SIZE * num_buckets_to_read);
+        // printf("error, num_buckets_to_read is not a multiple of num_buckets, exiting: num_buckets=%llu num_buckets_to_read=%llu...\n",num_buckets,num_buckets_to_read);
+        // return EXIT_FAILURE;
+    }
+    return num_buckets_to_read;
+}
+
+// Function to time transpose_batch against the per-slice reference loop on one shuffle group
+void run_transpose_benchmark(unsigned long long num_buckets_to_read)
+{
+    size_t buffer_bytes = num_buckets_to_read * num_records_in_bucket * rounds * sizeof(MemoRecord);
+    double group_mb = buffer_bytes / (1024 * 1024.0);
+    size_t arena_size;
+    bool huge_pages;
+    MemoRecord *buffer = (MemoRecord *)allocate_arena(buffer_bytes, &arena_size, &huge_pages);
+    MemoRecord *reference = (MemoRecord *)allocate_arena(buffer_bytes, &arena_size, &huge_pages);
+    MemoRecord *bufferShuffled = (MemoRecord *)allocate_arena(buffer_bytes, &arena_size, &huge_pages);
+    if (buffer == NULL || reference == NULL || bufferShuffled == NULL)
+    {
+        fprintf(stderr, "Error allocating memory for transpose benchmark buffers.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Distinct bytes everywhere, so any misplaced run is caught below
+    for (size_t i = 0; i < buffer_bytes; i++)
+    {
+        ((uint8_t *)buffer)[i] = (uint8_t)(i * 2654435761ULL >> 13);
+    }
+
+    double best_reference = 0.0;
+    double best_batch = 0.0;
+    for (int iteration = 0; iteration < TRANSPOSE_BENCH_ITERATIONS; iteration++)
+    {
+        double start_time = omp_get_wtime();
+        for (unsigned long long r = 0; r < rounds; r++)
+        {
+            transpose_slice(reference, buffer, r, num_buckets_to_read);
+        }
+        double elapsed_time = omp_get_wtime() - start_time;
+        if (best_reference == 0.0 || elapsed_time < best_reference)
+        {
+            best_reference = elapsed_time;
+        }
+
+        start_time = omp_get_wtime();
+        transpose_batch(bufferShuffled, buffer, num_buckets_to_read, rounds, num_records_in_bucket);
+        elapsed_time = omp_get_wtime() - start_time;
+        if (best_batch == 0.0 || elapsed_time < best_batch)
+        {
+            best_batch = elapsed_time;
+        }
+    }
+
+    bool same = memcmp(reference, bufferShuffled, buffer_bytes) == 0;
+    if (!BENCHMARK)
+    {
+        printf("Transpose Benchmark         : %llu buckets x %llu rounds of %llu records, %.2f MB per group, best of %d\n",
+               num_buckets_to_read, rounds, num_records_in_bucket, group_mb, TRANSPOSE_BENCH_ITERATIONS);
+        printf("Per-Slice Loop              : %.2f MB/s\n", group_mb / best_reference);
+        printf("Blocked Streaming Kernel    : %.2f MB/s (%.2fx)\n", group_mb / best_batch, best_reference / best_batch);
+        printf("Output Check                : %s\n", same ? "identical" : "MISMATCH");
+    }
+    else
+    {
+        printf("%llu %llu %llu %.2f %.2f %.2f %d\n", num_buckets_to_read, rounds, num_records_in_bucket, group_mb, group_mb / best_reference, group_mb / best_batch, same);
+    }
+
+    munmap(buffer, arena_size);
+    munmap(reference, arena_size);
+    munmap(bufferShuffled, arena_size);
+
+    if (!same)
+    {
+        exit(EXIT_FAILURE);
+    }
+}
+
+void semaphore_init(semaphore_t *sem, int initial_count)
+{
+    pthread_mutex_init(&sem->mutex, NULL);
+    pthread_cond_init(&sem->condition, NULL);
+    sem->count = initial_count;
+}
+
+void semaphore_wait(semaphore_t *sem)
+{
+    pthread_mutex_lock(&sem->mutex);
+    while (sem->count <= 0)
+    {
+        pthread_cond_wait(&sem->condition, &sem->mutex);
+    }
+    sem->count--;
+    pthread_mutex_unlock(&sem->mutex);
+}
+
+void semaphore_post(semaphore_t *sem)
+{
+    pthread_mutex_lock(&sem->mutex);
+    sem->count++;
+    pthread_cond_signal(&sem->condition);
+    pthread_mutex_unlock(&sem->mutex);
+}
+
+void semaphore_destroy(semaphore_t *sem)
+{
+    pthread_mutex_destroy(&sem->mutex);
+    pthread_cond_destroy(&sem->condition);
+}
+
+// Function to pass a hint for the source ranges of group g of the current destination slice
+void advise_shuffle_group(const ShufflePipeline *p, unsigned long long g, int advice)
+{
+    unsigned long long i = g * p->num_buckets_to_read;
+    for (unsigned long long r = 0; r < p->slices; r++)
+    {
+        off_t offset_src = (((p->first_slice + r) * p->num_buckets + i) * p->slice_records) * sizeof(MemoRecord);
+        advise_file(p->fd_src, offset_src, p->records_per_batch * sizeof(MemoRecord), advice);
+    }
+}
+
+// Function run by the shuffle's reader thread: reads every source slice of each group
+void *shuffle_reader(void *arg)
+{
+    ShufflePipeline *p = (ShufflePipeline *)arg;
+
+    IoQueue io;
+    if (!io_queue_init(&io, IO_BACKEND, QUEUE_DEPTH))
+    {
+        fprintf(stderr, "Error: Unable to allocate memory for the I/O queue.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (unsigned long long g = 0; g < p->num_groups; g++)
+    {
+        int slot = g % SHUFFLE_RING_SLOTS;
+        unsigned long long i = g * p->num_buckets_to_read;
+        MemoRecord *buffer = p->input[slot];
+
+        semaphore_wait(&p->input_free);
+        double start_time_read = omp_get_wtime();
+
+        // Let the kernel fetch the next group's fragments while this one is read
+        if (g == 0)
+        {
+            advise_shuffle_group(p, g, POSIX_FADV_WILLNEED);
+        }
+        if (g + 1 < p->num_groups)
+        {
+            advise_shuffle_group(p, g + 1, POSIX_FADV_WILLNEED);
+        }
+
+        if (p->in_place)
+        {
+            // Each run of a round's slice goes straight to its place in its bucket,
+            // so the group is already in final order once every slice is read
+#pragma omp parallel for schedule(dynamic) num_threads(p->num_threads_io)
+            for (unsigned long long r = 0; r < p->slices; r++)
+            {
+                off_t offset_src = (((p->first_slice + r) * p->num_buckets + i) * p->slice_records) * sizeof(MemoRecord);
+                size_t run_bytes = p->slice_records * sizeof(MemoRecord);
+                if (run_bytes >= SCATTER_MIN_RUN_BYTES)
+                {
+                    struct iovec *iov = (struct iovec *)malloc(p->num_buckets_to_read * sizeof(struct iovec));
+                    if (iov == NULL)
+                    {
+                        fprintf(stderr, "Error: Unable to allocate memory for the scatter list.\n");
+                        exit(EXIT_FAILURE);
+                    }
+                    for (unsigned long long s = 0; s < p->num_buckets_to_read; s++)
+                    {
+                        iov[s].iov_base = &buffer[(s * p->slices + r) * p->slice_records];
+                        iov[s].iov_len = run_bytes;
+                    }
+                    preadv_fully(p->fd_src, iov, p->num_buckets_to_read, offset_src);
+                    free(iov);
+                }
+                else
+                {
+                    // Short runs cost more per scatter entry than to copy, so read
+                    // whole runs in IO_CHUNK_SIZE pieces and place them from there
+                    unsigned long long chunk_runs = IO_CHUNK_SIZE / run_bytes;
+                    uint8_t *bounce = (uint8_t *)malloc(chunk_runs * run_bytes);
+                    if (bounce == NULL)
+                    {
+                        fprintf(stderr, "Error: Unable to allocate memory for the bounce buffer.\n");
+                        exit(EXIT_FAILURE);
+                    }
+                    for (unsigned long long s = 0; s < p->num_buckets_to_read; s += chunk_runs)
+                    {
+                        unsigned long long count = p->num_buckets_to_read - s < chunk_runs ? p->num_buckets_to_read - s : chunk_runs;
+                        pread_fully(p->fd_src, bounce, count * run_bytes, offset_src + s * run_bytes);
+                        for (unsigned long long k = 0; k < count; k++)
+                        {
+                            copy_run((uint8_t *)&buffer[((s + k) * p->slices + r) * p->slice_records], bounce + k * run_bytes, run_bytes);
+                        }
+                    }
+                    free(bounce);
+                }
+            }
+        }
+        else if (io.kind == IO_BACKEND_SYNC)
+        {
+            // Positional reads share no file position, so every round's slice
+            // is read by its own thread, straight into its part of the buffer
+#pragma omp parallel for schedule(dynamic) num_threads(p->num_threads_io)
+            for (unsigned long long r = 0; r < p->slices; r++)
+            {
+                off_t offset_src = (((p->first_slice + r) * p->num_buckets + i) * p->slice_records) * sizeof(MemoRecord);
+                pread_fully(p->fd_src, &buffer[r * p->records_per_batch], p->records_per_batch * sizeof(MemoRecord), offset_src);
+            }
+        }
+        else
+        {
+            for (unsigned long long r = 0; r < p->slices; r++)
+            {
+                // Calculate the source offset
+                off_t offset_src = (((p->first_slice + r) * p->num_buckets + i) * p->slice_records) * sizeof(MemoRecord);
+                if (DEBUG)
+                    printf("read data: offset_src=%lu bytes=%lu\n",
+                           offset_src, p->records_per_batch * sizeof(MemoRecord));
+
+                io_queue_read(&io, p->fd_src, &buffer[r * p->records_per_batch], p->records_per_batch * sizeof(MemoRecord), offset_src, r);
+            }
+            io_queue_drain(&io);
+        }
+
+        // The group is never read again, its pages can go
+        advise_shuffle_group(p, g, POSIX_FADV_DONTNEED);
+
+        p->input_read_time[slot] = omp_get_wtime() - start_time_read;
+        p->elapsed_time_read_total += p->input_read_time[slot];
+        semaphore_post(&p->input_full);
+    }
+
+    io_queue_free(&io);
+    return NULL;
+}
+
+// Function run by the shuffle's writer thread: writes each transposed group to its destination slice
+void *shuffle_writer(void *arg)
+{
+    ShufflePipeline *p = (ShufflePipeline *)arg;
+    double batch_mb = p->buffer_size * sizeof(MemoRecord) / (1024 * 1024.0);
+
+    IoQueue io;
+    if (!io_queue_init(&io, IO_BACKEND, QUEUE_DEPTH))
+    {
+        fprintf(stderr, "Error: Unable to allocate memory for the I/O queue.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (unsigned long long g = 0; g < p->num_groups; g++)
+    {
+        int slot = g % SHUFFLE_RING_SLOTS;
+        unsigned long long i = g * p->num_buckets_to_read;
+
+        semaphore_wait(&p->output_full);
+        double start_time_write = omp_get_wtime();
+
+        off_t offset_dest = ((p->dest_slice * p->num_buckets + i) * p->slices * p->slice_records) * sizeof(MemoRecord);
+        if (DEBUG)
+            printf("write data: offset_dest=%lu bytes=%lu\n", offset_dest, p->buffer_size * sizeof(MemoRecord));
+        io_queue_write(&io, p->fd_dest, p->output[slot], p->buffer_size * sizeof(MemoRecord), offset_dest, g);
+        io_queue_drain(&io);
+        writeback_range(&p->writeback, offset_dest, p->buffer_size * sizeof(MemoRecord));
+
+        double end_time_write = omp_get_wtime();
+        double elapsed_time_write = end_time_write - start_time_write;
+        p->elapsed_time_write_total += elapsed_time_write;
+
+        // Group throughput is measured between consecutive completed writes
+        double elapsed_time_group = end_time_write - p->last_group_time;
+        p->last_group_time = end_time_write;
+        // Progress of the whole shuffle, all passes included
+        double progress = (p->pass + (p->groups_done + g + 1) / (double)p->groups_in_pass) * 100.0 / p->num_passes;
+        // Stripes advance together, the first one reports for all of them
+        bool report = !BENCHMARK && p->stripe <= 0;
+        if (report && p->in_place)
+            printf("[%.2f] Shuffle %.2f%%: %.2f MB/s (scatter read %.2f MB/s, write %.2f MB/s)\n", end_time_write - p->start_time, progress, batch_mb / elapsed_time_group,
+                   batch_mb / p->output_read_time[slot], batch_mb / elapsed_time_write);
+        else if (report)
+            printf("[%.2f] Shuffle %.2f%%: %.2f MB/s (read %.2f MB/s, transpose %.2f MB/s, write %.2f MB/s)\n", end_time_write - p->start_time, progress, batch_mb / elapsed_time_group,
+                   batch_mb / p->output_read_time[slot], batch_mb / p->output_transpose_time[slot], batch_mb / elapsed_time_write);
+
+        // In place, the written buffer is the reader's to fill again
+        semaphore_post(p->in_place ? &p->input_free : &p->output_free);
+    }
+
+    io_queue_free(&io);
+    return NULL;
+}
+
+// Function to run the shuffle pipeline over every group of one destination slice;
+// the calling thread does the transposes, phase times add up in the pipeline
+void run_shuffle_pipeline(ShufflePipeline *p)
+{
+    semaphore_init(&p->input_free, SHUFFLE_RING_SLOTS);
+    semaphore_init(&p->input_full, 0);
+    semaphore_init(&p->output_free, SHUFFLE_RING_SLOTS);
+    semaphore_init(&p->output_full, 0);
+    p->last_group_time = omp_get_wtime();
+
+    pthread_t reader;
+    pthread_t writer;
+    if (pthread_create(&reader, NULL, shuffle_reader, p) != 0 ||
+        pthread_create(&writer, NULL, shuffle_writer, p) != 0)
+    {
+        perror("Error creating shuffle threads");
+        exit(EXIT_FAILURE);
+    }
+
+    for (unsigned long long g = 0; g < p->num_groups; g++)
+    {
+        int slot = g % SHUFFLE_RING_SLOTS;
+
+        semaphore_wait(&p->input_full);
+        if (p->in_place)
+        {
+            // Nothing to transpose, hand the group on to the writer
+            p->output_read_time[slot] = p->input_read_time[slot];
+            semaphore_post(&p->output_full);
+            continue;
+        }
+        semaphore_wait(&p->output_free);
+
+        if (DEBUG)
+            printf("shuffling %llu buckets with %llu bytes each...\n", p->num_buckets_to_read * p->slices, p->slice_records * NONCE_SIZE);
+        double start_time_transpose = omp_get_wtime();
+        transpose_batch(p->output[slot], p->input[slot], p->num_buckets_to_read, p->slices, p->slice_records);
+        p->output_transpose_time[slot] = omp_get_wtime() - start_time_transpose;
+        p->elapsed_time_transpose_total += p->output_transpose_time[slot];
+        p->output_read_time[slot] = p->input_read_time[slot];
+
+        semaphore_post(&p->input_free);
+        semaphore_post(&p->output_full);
+    }
+
+    pthread_join(reader, NULL);
+    pthread_join(writer, NULL);
+
+    semaphore_destroy(&p->input_free);
+    semaphore_destroy(&p->input_full);
+    semaphore_destroy(&p->output_free);
+    semaphore_destroy(&p->output_full);
+}
+
+// Function to concatenate two strings and return the result
+char *concat_strings(const char *str1, const char *str2)
+{
+    // Check for NULL pointers
+    if (str1 == NULL || str2 == NULL)
+    {
+        fprintf(stderr, "Error: NULL string passed to concat_strings.\n");
+        return NULL;
+    }
+
+    // Calculate the lengths of the input strings
+    size_t len1 = strlen(str1);
+    size_t len2 = strlen(str2);
+
+    // Allocate memory for the concatenated string (+1 for the null terminator)
+    char *result = (char *)malloc(len1 + len2 + 1);
+    if (result == NULL)
+    {
+        fprintf(stderr, "Error: Memory allocation failed in concat_strings.\n");
+        return NULL;
+    }
+
+    // Copy the first string into the result
+    strcpy(result, str1);
+
+    // Append the second string to the result
+    strcat(result, str2);
+
+    return result;
+}
+
+// Function to check if a nonce is non-zero
+bool is_nonce_nonzero(const uint8_t *nonce, size_t nonce_size)
+{
+    // Check for NULL pointer
+    if (nonce == NULL)
+    {
+        // Handle error as needed
+        return false;
+    }
+
+    // Iterate over each byte of the nonce
+    for (size_t i = 0; i < nonce_size; ++i)
+    {
+        if (nonce[i] != 0)
+        {
+            // Found a non-zero byte
+            return true;
+        }
+    }
+
+    // All bytes are zero
+    return false;
+}
+
+// Function to count zero-value MemoRecords in a binary file
+size_t count_zero_memo_records(const char *filename)
+{
+    const size_t BATCH_SIZE = 1000000; // 1 million MemoRecords per batch
+    MemoRecord *buffer = NULL;
+    size_t total_zero_records = 0;
+    size_t total_nonzero_records = 0;
+    size_t records_read;
+    FILE *file = NULL;
+
+    // Open the file for reading in binary mode
+    file = fopen(filename, "rb");
+    if (file == NULL)
+    {
+
+        printf("Error opening file %s (#1)\n", filename);
+        return 0;
+    }
+
+    // Allocate memory for the batch of MemoRecords
+    buffer = (MemoRecord *)malloc(BATCH_SIZE * sizeof(MemoRecord));
+    if (buffer == NULL)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory.\n");
+        fclose(file);
+        return 0;
+    }
+
+    // Read the file in batches
+    while ((records_read = fread(buffer, sizeof(MemoRecord), BATCH_SIZE, file)) > 0)
+    {
+        // Process each MemoRecord in the batch
+        for (size_t i = 0; i < records_read; ++i)
+        {
+            // Check if the MemoRecord's nonce is all zeros
+            if (is_nonce_nonzero(buffer[i].nonce, NONCE_SIZE))
+            {
+                ++total_nonzero_records;
+            }
+            else
+            {
+                ++total_zero_records;
+            }
+        }
+    }
+
+    // Check for reading errors
+    if (ferror(file))
+    {
+        perror("Error reading file");
+    }
+
+    // Clean up
+    fclose(file);
+    free(buffer);
+
+    // Print the total number of zero-value MemoRecords
+    printf("total_zero_records=%zu total_nonzero_records=%zu efficiency=%.2f%%\n", total_zero_records, total_nonzero_records, total_nonzero_records * 100.0 / (total_zero_records + total_nonzero_records));
+
+    return total_zero_records;
+}
+
+// Function to read the layout of a plot file holding num_buckets_file buckets; files
+// without a footer are bucket-major
+bool read_plot_layout(const char *filename, unsigned long long num_buckets_file, PlotLayout *layout)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+    {
+        printf("Error opening file %s (#8)\n", filename);
+        perror("Error opening file");
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        perror("Error getting file size");
+        close(fd);
+        return false;
+    }
+
+    unsigned long long bucket_bytes = num_buckets_file * sizeof(MemoRecord);
+    unsigned long long footer_size = (unsigned long long)st.st_size % bucket_bytes;
+    PlotFooter footer;
+    memset(&footer, 0, sizeof(footer));
+    if ((footer_size == sizeof(PlotFooter) || footer_size == PLOT_FOOTER_V1_SIZE) &&
+        pread(fd, &footer, footer_size, st.st_size - footer_size) == (ssize_t)footer_size &&
+        footer.magic == PLOT_FOOTER_MAGIC)
+    {
+        close(fd);
+        unsigned expected_version = footer_size == sizeof(PlotFooter) ? PLOT_FOOTER_VERSION : 1;
+        if (footer.version != expected_version || footer.nonce_size != NONCE_SIZE)
+        {
+            fprintf(stderr, "Error: %s has plot format version %u with %u byte nonces, expected version %u with %d byte nonces\n",
+                    filename, footer.version, footer.nonce_size, expected_version, NONCE_SIZE);
+            return false;
+        }
+        layout->slices = footer.slices;
+        layout->records_in_slice = footer.records_in_slice;
+        layout->group_buckets = footer.group_buckets;
+        layout->flags = footer.flags;
+        return true;
+    }
+    close(fd);
+
+    layout->slices = 1;
+    layout->records_in_slice = st.st_size / bucket_bytes;
+    layout->group_buckets = 1;
+    layout->flags = 0;
+    return true;
+}
+
+// Function to get the path of stripe k of a striped plot: the plot file's name,
+// suffixed with the stripe number, in the stripe's directory
+char *stripe_path(const char *dir, const char *filename, int k)
+{
+    const char *base = strrchr(filename, '/');
+    base = base == NULL ? filename : base + 1;
+    size_t length = strlen(dir) + strlen(base) + 16;
+    char *path = (char *)malloc(length);
+    if (path == NULL)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory.\n");
+        exit(EXIT_FAILURE);
+    }
+    snprintf(path, length, "%s/%s.%d", dir, base, k);
+    return path;
+}
+
+// Function to write the manifest of a striped plot, which stands in for the plot file
+bool write_stripe_manifest(const char *filename, char *const *paths, int count, unsigned long long stripe_buckets)
+{
+    FILE *file = fopen(filename, "w");
+    if (file == NULL)
+    {
+        printf("Error opening file %s (#9)\n", filename);
+        perror("Error opening file");
+        return false;
+    }
+    fprintf(file, "%s %d %llu\n", STRIPE_MANIFEST_MAGIC, count, stripe_buckets);
+    for (int k = 0; k < count; k++)
+    {
+        fprintf(file, "%s\n", paths[k]);
+    }
+    if (fflush(file) != 0 || sync_file_data(fileno(file)) != 0)
+    {
+        perror("Error writing stripe manifest");
+        fclose(file);
+        return false;
+    }
+    return fclose(file) == 0;
+}
 
-    // Read the file in batches
-    while ((records_read = fread(buffer, sizeof(MemoRecord), BATCH_SIZE, file)) > 0)
+// Function to find the files of a plot and their layout: a stripe manifest lists
+// one file per stripe, any other file is the whole plot
+bool open_plot_stripes(const char *filename, PlotStripes *stripes)
+{
+    FILE *file = fopen(filename, "r");
+    if (file == NULL)
     {
-        double start_time_verify = omp_get_wtime();
-        double end_time_verify = omp_get_wtime();
+        printf("Error opening file %s (#10)\n", filename);
+        perror("Error opening file");
+        return false;
+    }
 
-        // Process each MemoRecord in the batch
-        for (size_t i = 0; i < records_read; ++i)
+    char magic[16];
+    int count = 0;
+    unsigned long long stripe_buckets = 0;
+    unsigned long long plot_buckets = 1ULL << (PREFIX_SIZE * 8);
+    bool striped = fscanf(file, "%15s %d %llu", magic, &count, &stripe_buckets) == 3 && strcmp(magic, STRIPE_MANIFEST_MAGIC) == 0;
+    stripes->count = 0;
+    if (!striped)
+    {
+        fclose(file);
+        stripes->count = 1;
+        stripes->stripe_buckets = plot_buckets;
+        stripes->paths[0] = strdup(filename);
+        return read_plot_layout(filename, plot_buckets, &stripes->layout);
+    }
+
+    if (count < 1 || count > MAX_STRIPES || count * stripe_buckets != plot_buckets)
+    {
+        fprintf(stderr, "Error: %s lists %d stripes of %llu buckets, expected %llu buckets in at most %d stripes\n",
+                filename, count, stripe_buckets, plot_buckets, MAX_STRIPES);
+        fclose(file);
+        return false;
+    }
+    stripes->stripe_buckets = stripe_buckets;
+
+    char path[4096];
+    for (int k = -1; k < count; k++)
+    {
+        // Line -1 is the rest of the header
+        if (fgets(path, sizeof(path), file) == NULL)
+        {
+            fprintf(stderr, "Error: %s lists fewer than %d stripes\n", filename, count);
+            fclose(file);
+            return false;
+        }
+        if (k < 0)
         {
-            ++total_records;
+            continue;
+        }
+        path[strcspn(path, "\n")] = '\0';
+        stripes->paths[stripes->count++] = strdup(path);
 
-            if (is_nonce_nonzero(buffer[i].nonce, NONCE_SIZE))
+        PlotLayout layout;
+        if (!read_plot_layout(path, stripe_buckets, &layout))
+        {
+            fclose(file);
+            return false;
+        }
+        if (k > 0 && memcmp(&layout, &stripes->layout, sizeof(layout)) != 0)
+        {
+            fprintf(stderr, "Error: stripe %s does not have the layout of the other stripes\n", path);
+            fclose(file);
+            return false;
+        }
+        stripes->layout = layout;
+    }
+    fclose(file);
+    return true;
+}
+
+// Function to free the file names of a plot's stripes
+void free_plot_stripes(PlotStripes *stripes)
+{
+    for (int k = 0; k < stripes->count; k++)
+    {
+        free(stripes->paths[k]);
+    }
+    stripes->count = 0;
+}
+
+// Function to append the layout footer to a plot file of buckets_in_file buckets written
+// with a grouped layout or with flags, replacing any footer it already has
+bool write_plot_footer(const char *filename, const PlotLayout *layout, unsigned long long buckets_in_file)
+{
+    PlotFooter footer;
+    memset(&footer, 0, sizeof(footer));
+    footer.magic = PLOT_FOOTER_MAGIC;
+    footer.version = PLOT_FOOTER_VERSION;
+    footer.nonce_size = NONCE_SIZE;
+    footer.slices = layout->slices;
+    footer.records_in_slice = layout->records_in_slice;
+    footer.group_buckets = layout->group_buckets;
+    footer.flags = layout->flags;
+
+    int fd = open(filename, O_WRONLY);
+    if (fd < 0)
+    {
+        perror("Error opening file");
+        return false;
+    }
+    off_t offset = buckets_in_file * layout->slices * layout->records_in_slice * sizeof(MemoRecord);
+    pwrite_fully(fd, &footer, sizeof(footer), offset);
+    return close(fd) == 0;
+}
+
+// Function to order records by the hash of their nonces; ties on the leading bytes are
+// rare enough to be settled by hashing both nonces again
+int compare_hash_sort_entries(const void *a, const void *b)
+{
+    const HashSortEntry *x = (const HashSortEntry *)a;
+    const HashSortEntry *y = (const HashSortEntry *)b;
+    if (x->key != y->key)
+        return x->key < y->key ? -1 : 1;
+
+    uint8_t hash_x[BLAKE3_OUT_LEN];
+    uint8_t hash_y[BLAKE3_OUT_LEN];
+    blake3_hash_nonce(x->record.nonce, NONCE_SIZE, hash_x, BLAKE3_OUT_LEN);
+    blake3_hash_nonce(y->record.nonce, NONCE_SIZE, hash_y, BLAKE3_OUT_LEN);
+    int order = memcmp(hash_x, hash_y, BLAKE3_OUT_LEN);
+    return order != 0 ? order : memcmp(x->record.nonce, y->record.nonce, NONCE_SIZE);
+}
+
+// Function to sort a bucket's entries by hash
+void sort_hash_sort_entries(HashSortEntry *entries, unsigned long long count)
+{
+    // Buckets rarely hold more than a few dozen records, where insertion sort beats qsort
+    if (count > HASH_SORT_INSERTION_MAX)
+    {
+        qsort(entries, count, sizeof(HashSortEntry), compare_hash_sort_entries);
+        return;
+    }
+    for (unsigned long long i = 1; i < count; i++)
+    {
+        HashSortEntry entry = entries[i];
+        unsigned long long j = i;
+        while (j > 0 && compare_hash_sort_entries(&entry, &entries[j - 1]) < 0)
+        {
+            entries[j] = entries[j - 1];
+            j--;
+        }
+        entries[j] = entry;
+    }
+}
+
+// Function to sort buckets records_in_bucket records each, stored back to back, by the
+// hash of their nonces, moving empty records to the end of each bucket. Buckets are
+// taken a chunk at a time so that their nonces fill the SIMD lanes of one hashing call
+void hash_sort_buckets(MemoRecord *records, unsigned long long buckets, unsigned long long records_in_bucket)
+{
+    unsigned long long chunk_buckets = HASH_SORT_CHUNK_RECORDS / records_in_bucket > 0 ? HASH_SORT_CHUNK_RECORDS / records_in_bucket : 1;
+    unsigned long long num_chunks = (buckets + chunk_buckets - 1) / chunk_buckets;
+    unsigned long long chunk_records = chunk_buckets * records_in_bucket;
+
+#pragma omp parallel
+    {
+        HashSortEntry *entries = (HashSortEntry *)malloc(chunk_records * sizeof(HashSortEntry));
+        const uint8_t **nonces = (const uint8_t **)malloc(chunk_records * sizeof(uint8_t *));
+        uint8_t *hashes = (uint8_t *)malloc(chunk_records * sizeof(uint64_t));
+        unsigned long long *starts = (unsigned long long *)malloc((chunk_buckets + 1) * sizeof(unsigned long long));
+        if (entries == NULL || nonces == NULL || hashes == NULL || starts == NULL)
+        {
+            fprintf(stderr, "Error: Unable to allocate memory.\n");
+            exit(EXIT_FAILURE);
+        }
+
+#pragma omp for schedule(static)
+        for (unsigned long long c = 0; c < num_chunks; c++)
+        {
+            MemoRecord *chunk = &records[c * chunk_records];
+            unsigned long long num = buckets - c * chunk_buckets < chunk_buckets ? buckets - c * chunk_buckets : chunk_buckets;
+
+            // Gather the nonzero records of every bucket, starts[b] is where bucket b begins
+            unsigned long long count = 0;
+            for (unsigned long long b = 0; b < num; b++)
+            {
+                starts[b] = count;
+                for (unsigned long long i = 0; i < records_in_bucket; i++)
+                {
+                    const MemoRecord *record = &chunk[b * records_in_bucket + i];
+                    if (is_nonce_nonzero(record->nonce, NONCE_SIZE))
+                    {
+                        entries[count].record = *record;
+                        nonces[count] = entries[count].record.nonce;
+                        count++;
+                    }
+                }
+            }
+            starts[num] = count;
+
+            blake3_hash_many_nonce(nonces, count, NONCE_SIZE, hashes, sizeof(uint64_t));
+            for (unsigned long long i = 0; i < count; i++)
+            {
+                uint64_t key = 0;
+                for (size_t j = 0; j < sizeof(uint64_t); j++)
+                {
+                    key = (key << 8) | hashes[i * sizeof(uint64_t) + j];
+                }
+                entries[i].key = key;
+            }
+
+            for (unsigned long long b = 0; b < num; b++)
+            {
+                MemoRecord *bucket = &chunk[b * records_in_bucket];
+                unsigned long long bucket_count = starts[b + 1] - starts[b];
+                sort_hash_sort_entries(&entries[starts[b]], bucket_count);
+                for (unsigned long long i = 0; i < bucket_count; i++)
+                {
+                    bucket[i] = entries[starts[b] + i].record;
+                }
+                memset(&bucket[bucket_count], 0, (records_in_bucket - bucket_count) * sizeof(MemoRecord));
+            }
+        }
+
+        free(starts);
+        free(hashes);
+        free(nonces);
+        free(entries);
+    }
+}
+
+// Function to move whole groups of a grouped layout between file order, where a group
+// stores slice 0 of all its buckets, then slice 1, and bucket order
+void regroup_buckets(const PlotLayout *layout, unsigned long long groups, MemoRecord *file_order, MemoRecord *bucket_order, bool to_bucket_order)
+{
+    unsigned long long group_records = layout->group_buckets * layout->slices * layout->records_in_slice;
+    size_t run_bytes = layout->records_in_slice * sizeof(MemoRecord);
+
+#pragma omp parallel for schedule(static)
+    for (unsigned long long g = 0; g < groups; g++)
+    {
+        for (unsigned long long b = 0; b < layout->group_buckets; b++)
+        {
+            for (unsigned long long r = 0; r < layout->slices; r++)
+            {
+                MemoRecord *file_run = &file_order[g * group_records + (r * layout->group_buckets + b) * layout->records_in_slice];
+                MemoRecord *bucket_run = &bucket_order[g * group_records + (b * layout->slices + r) * layout->records_in_slice];
+                if (to_bucket_order)
+                    memcpy(bucket_run, file_run, run_bytes);
+                else
+                    memcpy(file_run, bucket_run, run_bytes);
+            }
+        }
+    }
+}
+
+// Function to sort every bucket of a plot file of buckets_in_file buckets by hash in
+// place and flag it in the footer. Whole groups are one contiguous range of the file
+// in every layout, so the file is rewritten a batch of groups at a time
+bool hash_sort_plot_file(const char *filename, unsigned long long buckets_in_file)
+{
+    PlotLayout layout;
+    if (!read_plot_layout(filename, buckets_in_file, &layout))
+    {
+        return false;
+    }
+
+    int fd = open(filename, O_RDWR);
+    if (fd < 0)
+    {
+        printf("Error opening file %s (#9)\n", filename);
+        perror("Error opening file");
+        return false;
+    }
+
+    unsigned long long records_in_bucket = layout.slices * layout.records_in_slice;
+    unsigned long long group_records = layout.group_buckets * records_in_bucket;
+    unsigned long long num_groups = buckets_in_file / layout.group_buckets;
+    unsigned long long batch_groups = HASH_SORT_BATCH_SIZE / (group_records * sizeof(MemoRecord));
+    batch_groups = batch_groups > 0 ? batch_groups : 1;
+    batch_groups = batch_groups < num_groups ? batch_groups : num_groups;
+
+    MemoRecord *file_order = (MemoRecord *)malloc(batch_groups * group_records * sizeof(MemoRecord));
+    MemoRecord *bucket_order = layout.group_buckets > 1 ? (MemoRecord *)malloc(batch_groups * group_records * sizeof(MemoRecord)) : file_order;
+    if (file_order == NULL || bucket_order == NULL)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory for the hash sort.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    WritebackGovernor wb;
+    writeback_init(&wb, fd);
+    for (unsigned long long g = 0; g < num_groups; g += batch_groups)
+    {
+        unsigned long long groups = num_groups - g < batch_groups ? num_groups - g : batch_groups;
+        size_t bytes = groups * group_records * sizeof(MemoRecord);
+        off_t offset = g * group_records * sizeof(MemoRecord);
+
+        pread_fully(fd, file_order, bytes, offset);
+        if (layout.group_buckets > 1)
+        {
+            regroup_buckets(&layout, groups, file_order, bucket_order, true);
+        }
+        hash_sort_buckets(bucket_order, groups * layout.group_buckets, records_in_bucket);
+        if (layout.group_buckets > 1)
+        {
+            regroup_buckets(&layout, groups, file_order, bucket_order, false);
+        }
+        pwrite_fully(fd, file_order, bytes, offset);
+        writeback_range(&wb, offset, bytes);
+    }
+    writeback_finish(&wb);
+
+    if (bucket_order != file_order)
+    {
+        free(bucket_order);
+    }
+    free(file_order);
+    if (close(fd) != 0)
+    {
+        perror("Error closing file");
+        return false;
+    }
+
+    layout.flags |= PLOT_FLAG_HASH_SORTED;
+    return write_plot_footer(filename, &layout, buckets_in_file);
+}
+
+// Function to read the records of batch_buckets buckets, starting at bucket first_bucket,
+// into buffer in bucket-major order; grouped layouts are read a group at a time through scratch
+void read_plot_buckets(FILE *file, const PlotLayout *layout, unsigned long long first_bucket, unsigned long long batch_buckets, MemoRecord *buffer, MemoRecord *scratch)
+{
+    unsigned long long records_in_bucket = layout->slices * layout->records_in_slice;
+
+    if (layout->group_buckets == 1)
+    {
+        if (fseeko(file, plot_slice_offset(layout, first_bucket, 0), SEEK_SET) != 0 ||
+            fread(buffer, sizeof(MemoRecord), batch_buckets * records_in_bucket, file) != batch_buckets * records_in_bucket)
+        {
+            perror("Error reading file");
+            exit(EXIT_FAILURE);
+        }
+        return;
+    }
+
+    for (unsigned long long g = first_bucket; g < first_bucket + batch_buckets; g += layout->group_buckets)
+    {
+        unsigned long long group_records = layout->group_buckets * records_in_bucket;
+        if (fseeko(file, plot_slice_offset(layout, g, 0), SEEK_SET) != 0 ||
+            fread(scratch, sizeof(MemoRecord), group_records, file) != group_records)
+        {
+            perror("Error reading file");
+            exit(EXIT_FAILURE);
+        }
+
+        // Gather the slices of each bucket of the group
+        MemoRecord *group_buffer = &buffer[(g - first_bucket) * records_in_bucket];
+        for (unsigned long long b = 0; b < layout->group_buckets; b++)
+        {
+            for (unsigned long long r = 0; r < layout->slices; r++)
+            {
+                memcpy(&group_buffer[(b * layout->slices + r) * layout->records_in_slice],
+                       &scratch[(r * layout->group_buckets + b) * layout->records_in_slice],
+                       layout->records_in_slice * sizeof(MemoRecord));
+            }
+        }
+    }
+}
+
+long get_file_size(const char *filename)
+{
+    FILE *file = fopen(filename, "rb"); // Open the file in binary mode
+    long size;
+
+    if (file == NULL)
+    {
+        printf("Error opening file %s (#2)\n", filename);
+
+        perror("Error opening file");
+        return -1;
+    }
+
+    // Move the file pointer to the end of the file
+    if (fseek(file, 0, SEEK_END) != 0)
+    {
+        perror("Error seeking to end of file");
+        fclose(file);
+        return -1;
+    }
+
+    // Get the current position in the file, which is the size
+    size = ftell(file);
+    if (size == -1L)
+    {
+        perror("Error getting file position");
+        fclose(file);
+        return -1;
+    }
+
+    fclose(file);
+    return size;
+}
+
+// Function to get the total size of a plot's stripes in bytes, -1 on error
+long get_plot_size(const PlotStripes *stripes)
+{
+    long size = 0;
+    for (int k = 0; k < stripes->count; k++)
+    {
+        long stripe_size = get_file_size(stripes->paths[k]);
+        if (stripe_size < 0)
+        {
+            return -1;
+        }
+        size += stripe_size;
+    }
+    return size;
+}
+
+size_t process_memo_records(const char *filename, const size_t BATCH_SIZE)
+{
+    // const size_t BATCH_SIZE = 1000000; // 1 million MemoRecords per batch
+    MemoRecord *buffer = NULL;
+    size_t total_records = 0;
+    size_t zero_nonce_count = 0;
+    size_t records_read;
+    FILE *file = NULL;
+    uint8_t prev_hash[PREFIX_SIZE] = {0}; // Initialize previous hash prefix to zero
+    uint8_t prev_nonce[NONCE_SIZE] = {0}; // Initialize previous nonce to zero
+    size_t count_condition_met = 0;       // Counter for records meeting the condition
+    size_t count_condition_not_met = 0;
+
+    // A striped plot is verified stripe after stripe, which is bucket order
+    PlotStripes stripes;
+    if (!open_plot_stripes(filename, &stripes))
+    {
+        return 0;
+    }
+    const PlotLayout layout = stripes.layout;
+
+    long filesize = get_plot_size(&stripes);
+
+    if (filesize != -1)
+    {
+        if (!BENCHMARK)
+            printf("Size of '%s' is %ld bytes.\n", filename, filesize);
+    }
+
+    unsigned long long records_in_bucket = layout.slices * layout.records_in_slice;
+
+    // Read whole buckets, and whole groups of a grouped layout, at a time
+    unsigned long long batch_buckets = layout.group_buckets;
+    while (batch_buckets * 2 <= stripes.stripe_buckets && batch_buckets * 2 * records_in_bucket <= BATCH_SIZE)
+    {
+        batch_buckets *= 2;
+    }
+
+    // Allocate memory for the batch of MemoRecords
+    MemoRecord *scratch = NULL;
+    buffer = (MemoRecord *)malloc(batch_buckets * records_in_bucket * sizeof(MemoRecord));
+    if (layout.group_buckets > 1)
+    {
+        scratch = (MemoRecord *)malloc(layout.group_buckets * records_in_bucket * sizeof(MemoRecord));
+    }
+    if (buffer == NULL || (layout.group_buckets > 1 && scratch == NULL))
+    {
+        fprintf(stderr, "Error: Unable to allocate memory.\n");
+        free_plot_stripes(&stripes);
+        return 0;
+    }
+
+    // Start walltime measurement
+    double start_time = omp_get_wtime();
+    // double end_time = omp_get_wtime();
+
+    for (int k = 0; k < stripes.count; k++)
+    {
+        // Open the file for reading in binary mode
+        file = fopen(stripes.paths[k], "rb");
+        if (file == NULL)
+        {
+            printf("Error opening file %s (#3)\n", stripes.paths[k]);
+
+            perror("Error opening file");
+            return 0;
+        }
+
+        // Read the file in batches, in bucket order
+        for (unsigned long long first_bucket = 0; first_bucket < stripes.stripe_buckets; first_bucket += batch_buckets)
+        {
+            read_plot_buckets(file, &layout, first_bucket, batch_buckets, buffer, scratch);
+            records_read = batch_buckets * records_in_bucket;
+
+            double start_time_verify = omp_get_wtime();
+            double end_time_verify = omp_get_wtime();
+
+            // Process each MemoRecord in the batch
+            for (size_t i = 0; i < records_read; ++i)
             {
-                uint8_t hash_output[HASH_SIZE];
+                ++total_records;
+
+                if (is_nonce_nonzero(buffer[i].nonce, NONCE_SIZE))
+                {
+                    uint8_t hash_output[PREFIX_SIZE];
+
+                    // Compute Blake3 hash of the nonce, only the prefix is compared
+                    blake3_hash_nonce(buffer[i].nonce, NONCE_SIZE, hash_output, PREFIX_SIZE);
+
+                    // Compare the first PREFIX_SIZE bytes of the current hash to the previous hash prefix
+                    if (memcmp(hash_output, prev_hash, PREFIX_SIZE) >= 0)
+                    {
+                        // Current hash's first PREFIX_SIZE bytes are equal to or greater than previous
+                        ++count_condition_met;
+                    }
+                    else
+                    {
+                        ++count_condition_not_met;
 
-                // Compute Blake3 hash of the nonce
-                blake3_hasher hasher;
-                blake3_hasher_init(&hasher);
-                blake3_hasher_update(&hasher, buffer[i].nonce, NONCE_SIZE);
-                blake3_hasher_finalize(&hasher, hash_output, HASH_SIZE);
+                        if (DEBUG)
+                        {
+                            // Print previous hash and nonce, and current hash and nonce
+                            printf("Condition not met at record %zu:\n", total_records);
+                            printf("Previous nonce: ");
+                            for (size_t n = 0; n < NONCE_SIZE; ++n)
+                                printf("%02X", prev_nonce[n]);
+                            printf("\n");
+                            printf("Previous hash prefix: ");
+                            for (size_t n = 0; n < PREFIX_SIZE; ++n)
+                                printf("%02X", prev_hash[n]);
+                            printf("\n");
+
+                            printf("Current nonce: ");
+                            for (size_t n = 0; n < NONCE_SIZE; ++n)
+                                printf("%02X", buffer[i].nonce[n]);
+                            printf("\n");
+                            printf("Current hash prefix: ");
+                            for (size_t n = 0; n < PREFIX_SIZE; ++n)
+                                printf("%02X", hash_output[n]);
+                            printf("\n");
+                        }
+                    }
 
-                // Compare the first PREFIX_SIZE bytes of the current hash to the previous hash prefix
-                if (memcmp(hash_output, prev_hash, PREFIX_SIZE) >= 0)
-                {
-                    // Current hash's first PREFIX_SIZE bytes are equal to or greater than previous
-                    ++count_condition_met;
+                    // Update the previous hash prefix and nonce
+                    memcpy(prev_hash, hash_output, PREFIX_SIZE);
+                    memcpy(prev_nonce, buffer[i].nonce, NONCE_SIZE);
                 }
                 else
                 {
-                    ++count_condition_not_met;
-
-                    if (DEBUG)
-                    {
-                        // Print previous hash and nonce, and current hash and nonce
-                        printf("Condition not met at record %zu:\n", total_records);
-                        printf("Previous nonce: ");
-                        for (size_t n = 0; n < NONCE_SIZE; ++n)
-                            printf("%02X", prev_nonce[n]);
-                        printf("\n");
-                        printf("Previous hash prefix: ");
-                        for (size_t n = 0; n < PREFIX_SIZE; ++n)
-                            printf("%02X", prev_hash[n]);
-                        printf("\n");
-
-                        printf("Current nonce: ");
-                        for (size_t n = 0; n < NONCE_SIZE; ++n)
-                            printf("%02X", buffer[i].nonce[n]);
-                        printf("\n");
-                        printf("Current hash prefix: ");
-                        for (size_t n = 0; n < PREFIX_SIZE; ++n)
-                            printf("%02X", hash_output[n]);
-                        printf("\n");
-                    }
+                    ++zero_nonce_count;
+                    // Optionally, handle zero nonces here
                 }
-
-                // Update the previous hash prefix and nonce
-                memcpy(prev_hash, hash_output, PREFIX_SIZE);
-                memcpy(prev_nonce, buffer[i].nonce, NONCE_SIZE);
-            }
-            else
-            {
-                ++zero_nonce_count;
-                // Optionally, handle zero nonces here
             }
+            end_time_verify = omp_get_wtime();
+            double elapsed_time_verify = end_time_verify - start_time_verify;
+            double elapsed_time = omp_get_wtime() - start_time;
+
+            // Calculate throughput (hashes per second)
+            double throughput = (records_read * sizeof(MemoRecord) / elapsed_time_verify) / (1024 * 1024);
+            printf("[%.2f] Verify %.2f%%: %.2f MB/s\n", elapsed_time, total_records * sizeof(MemoRecord) * 100.0 / filesize, throughput);
         }
-        end_time_verify = omp_get_wtime();
-        double elapsed_time_verify = end_time_verify - start_time_verify;
-        double elapsed_time = omp_get_wtime() - start_time;
 
-        // Calculate throughput (hashes per second)
-        double throughput = (BATCH_SIZE * sizeof(MemoRecord) / elapsed_time_verify) / (1024 * 1024);
-        printf("[%.2f] Verify %.2f%%: %.2f MB/s\n", elapsed_time, total_records * sizeof(MemoRecord) * 100.0 / filesize, throughput);
-    }
+        // Check for reading errors
+        if (ferror(file))
+        {
+            perror("Error reading file");
+        }
 
-    // Check for reading errors
-    if (ferror(file))
-    {
-        perror("Error reading file");
+        fclose(file);
     }
 
     // Clean up
-    fclose(file);
     free(buffer);
+    free(scratch);
+    free_plot_stripes(&stripes);
 
     // Print the total number of times the condition was met
     printf("sorted=%zu not_sorted=%zu zero_nonces=%zu total_records=%zu storage_efficiency=%.2f%%\n",
@@ -482,146 +2840,655 @@ uint8_t *convert_string_to_uint8_array(const char *SEARCH_STRING)
         return NULL;
     }
 
-    for (size_t i = 0; i < length; ++i)
-    {
-        array[i] = (uint8_t)SEARCH_STRING[i];
+    for (size_t i = 0; i < length; ++i)
+    {
+        array[i] = (uint8_t)SEARCH_STRING[i];
+    }
+
+    return array;
+}
+
+uint8_t *hexStringToByteArray(const char *hexString)
+{
+
+    size_t hexLen = strlen(hexString);
+    uint8_t *byteArray = (uint8_t *)malloc(hexLen * sizeof(uint8_t));
+    // size_t hexLen = strlen(hexString);
+    if (hexLen % 2 != 0)
+    {
+        return NULL; // Error: Invalid hexadecimal string length
+    }
+
+    size_t byteLen = hexLen / 2;
+    size_t byteArraySize = byteLen;
+    if (byteLen > byteArraySize)
+    {
+        return NULL; // Error: Byte array too small
+    }
+
+    for (size_t i = 0; i < byteLen; ++i)
+    {
+        if (sscanf(&hexString[i * 2], "%2hhx", &byteArray[i]) != 1)
+        {
+            return NULL; // Error: Failed to parse hexadecimal string
+        }
+    }
+
+    return byteArray;
+}
+
+// Function to map every stripe of a plot for random access; returns false, with nothing
+// left mapped, if one of them cannot be mapped
+bool plot_reader_map(PlotReader *reader)
+{
+    for (int k = 0; k < reader->stripes.count; k++)
+    {
+        struct stat st;
+        void *map = MAP_FAILED;
+        if (fstat(reader->fds[k], &st) == 0 && st.st_size > 0)
+        {
+            map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, reader->fds[k], 0);
+        }
+        if (map == MAP_FAILED)
+        {
+            perror("Warning: mmap of the plot failed, using read lookups");
+            while (k-- > 0)
+            {
+                munmap((void *)reader->maps[k], reader->map_sizes[k]);
+                reader->maps[k] = NULL;
+            }
+            return false;
+        }
+
+        // Lookups land on random buckets, so read-ahead would only waste the page cache
+        madvise(map, st.st_size, MADV_RANDOM);
+        reader->maps[k] = (const MemoRecord *)map;
+        reader->map_sizes[k] = st.st_size;
+    }
+    return true;
+}
+
+// Function to open a plot, or every stripe of a striped plot, for lookups in the given mode
+bool plot_reader_open(PlotReader *reader, const char *filename, LookupMode mode)
+{
+    if (!open_plot_stripes(filename, &reader->stripes))
+    {
+        return false;
+    }
+    reader->records_in_bucket = reader->stripes.layout.slices * reader->stripes.layout.records_in_slice;
+
+    for (int k = 0; k < reader->stripes.count; k++)
+    {
+        reader->fds[k] = open(reader->stripes.paths[k], O_RDONLY);
+        if (reader->fds[k] < 0)
+        {
+            printf("Error opening file %s (#3)\n", reader->stripes.paths[k]);
+            perror("Error opening file");
+            while (k-- > 0)
+            {
+                close(reader->fds[k]);
+            }
+            free_plot_stripes(&reader->stripes);
+            return false;
+        }
+        reader->maps[k] = NULL;
+        reader->map_sizes[k] = 0;
+    }
+
+    reader->mode = mode;
+    if (mode != LOOKUP_READ && !plot_reader_map(reader))
+    {
+        reader->mode = LOOKUP_READ;
+    }
+    return true;
+}
+
+// Function to close a plot opened for lookups
+void plot_reader_close(PlotReader *reader)
+{
+    for (int k = 0; k < reader->stripes.count; k++)
+    {
+        if (reader->maps[k] != NULL)
+        {
+            munmap((void *)reader->maps[k], reader->map_sizes[k]);
+        }
+        close(reader->fds[k]);
+    }
+    free_plot_stripes(&reader->stripes);
+}
+
+// Function to read every record of a bucket into buffer
+void plot_reader_read_bucket(const PlotReader *reader, unsigned long long bucketIndex, MemoRecord *buffer)
+{
+    const PlotStripes *stripes = &reader->stripes;
+    int fd = reader->fds[bucketIndex / stripes->stripe_buckets];
+    bucketIndex %= stripes->stripe_buckets;
+
+    // A bucket is one contiguous run in the classic layout, or one run per slice in a grouped layout
+    unsigned long long runs = stripes->layout.group_buckets == 1 ? 1 : stripes->layout.slices;
+    size_t run_records = reader->records_in_bucket / runs;
+    for (unsigned long long r = 0; r < runs; r++)
+    {
+        pread_fully(fd, &buffer[r * run_records], run_records * sizeof(MemoRecord), plot_slice_offset(&stripes->layout, bucketIndex, r));
+    }
+}
+
+// Function to queue the reads of a bucket into buffer on an I/O queue, all with the
+// given tag; returns the number of completions io_queue_wait will report for it
+unsigned long long plot_reader_queue_bucket(const PlotReader *reader, IoQueue *io, unsigned long long bucketIndex, MemoRecord *buffer, uint64_t tag)
+{
+    const PlotStripes *stripes = &reader->stripes;
+    int fd = reader->fds[bucketIndex / stripes->stripe_buckets];
+    bucketIndex %= stripes->stripe_buckets;
+
+    unsigned long long runs = stripes->layout.group_buckets == 1 ? 1 : stripes->layout.slices;
+    size_t run_records = reader->records_in_bucket / runs;
+    unsigned long long num_requests = 0;
+    for (unsigned long long r = 0; r < runs; r++)
+    {
+        num_requests += io_queue_read(io, fd, &buffer[r * run_records], run_records * sizeof(MemoRecord), plot_slice_offset(&stripes->layout, bucketIndex, r), tag);
+    }
+    return num_requests;
+}
+
+// Function to binary-search a bucket sorted by hash for a prefix of hash_length bytes, where
+// record i of the bucket is records[(i / records_in_slice) * run_stride + i % records_in_slice];
+// returns the nonce with the lowest hash starting with the prefix, or -1. Only the
+// O(log n) records probed are hashed, or even touched
+long long search_sorted_bucket(const MemoRecord *records, unsigned long long records_in_bucket, unsigned long long records_in_slice,
+                               unsigned long long run_stride, const uint8_t *prefix, size_t hash_length)
+{
+#define SORTED_RECORD(i) (&records[((i) / records_in_slice) * run_stride + (i) % records_in_slice])
+    // Empty records sort last
+    unsigned long long low = 0;
+    unsigned long long high = records_in_bucket;
+    while (low < high)
+    {
+        unsigned long long middle = low + (high - low) / 2;
+        if (is_nonce_nonzero(SORTED_RECORD(middle)->nonce, NONCE_SIZE))
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    // First record whose hash is not below the prefix
+    uint8_t hash_output[BLAKE3_OUT_LEN];
+    high = low;
+    low = 0;
+    while (low < high)
+    {
+        unsigned long long middle = low + (high - low) / 2;
+        blake3_hash_nonce(SORTED_RECORD(middle)->nonce, NONCE_SIZE, hash_output, hash_length);
+        if (memcmp(hash_output, prefix, hash_length) < 0)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    if (low < records_in_bucket && is_nonce_nonzero(SORTED_RECORD(low)->nonce, NONCE_SIZE))
+    {
+        blake3_hash_nonce(SORTED_RECORD(low)->nonce, NONCE_SIZE, hash_output, hash_length);
+        if (memcmp(hash_output, prefix, hash_length) == 0)
+        {
+            return byteArrayToLongLong(SORTED_RECORD(low)->nonce, NONCE_SIZE);
+        }
+    }
+    return -1;
+#undef SORTED_RECORD
+}
+
+// Function to find a hash prefix of prefix_length bytes in a bucket already read into
+// buffer; returns the first nonce whose hash starts with the prefix, or -1
+long long plot_reader_match_bucket(const PlotReader *reader, const MemoRecord *buffer, const uint8_t *prefix, size_t prefix_length)
+{
+    size_t hash_length = prefix_length < BLAKE3_OUT_LEN ? prefix_length : BLAKE3_OUT_LEN;
+    if (reader->stripes.layout.flags & PLOT_FLAG_HASH_SORTED)
+    {
+        return search_sorted_bucket(buffer, reader->records_in_bucket, reader->records_in_bucket, reader->records_in_bucket, prefix, hash_length);
+    }
+
+    for (unsigned long long i = 0; i < reader->records_in_bucket; i++)
+    {
+        if (!is_nonce_nonzero(buffer[i].nonce, NONCE_SIZE))
+        {
+            continue;
+        }
+
+        uint8_t hash_output[BLAKE3_OUT_LEN];
+        blake3_hash_nonce(buffer[i].nonce, NONCE_SIZE, hash_output, hash_length);
+        if (memcmp(hash_output, prefix, hash_length) == 0)
+        {
+            return byteArrayToLongLong(buffer[i].nonce, NONCE_SIZE);
+        }
+    }
+    return -1;
+}
+
+// Function to get the records of a bucket in bucket order: straight from the mapping
+// when the plot is mapped and the bucket is contiguous, otherwise copied into buffer
+const MemoRecord *plot_reader_bucket(const PlotReader *reader, unsigned long long bucketIndex, MemoRecord *buffer)
+{
+    if (reader->mode == LOOKUP_READ)
+    {
+        plot_reader_read_bucket(reader, bucketIndex, buffer);
+        return buffer;
+    }
+
+    const PlotStripes *stripes = &reader->stripes;
+    const MemoRecord *map = reader->maps[bucketIndex / stripes->stripe_buckets];
+    bucketIndex %= stripes->stripe_buckets;
+
+    unsigned long long runs = stripes->layout.group_buckets == 1 ? 1 : stripes->layout.slices;
+    if (runs == 1)
+    {
+        return &map[plot_slice_offset(&stripes->layout, bucketIndex, 0) / sizeof(MemoRecord)];
+    }
+
+    size_t run_records = reader->records_in_bucket / runs;
+    for (unsigned long long r = 0; r < runs; r++)
+    {
+        memcpy(&buffer[r * run_records], &map[plot_slice_offset(&stripes->layout, bucketIndex, r) / sizeof(MemoRecord)], run_records * sizeof(MemoRecord));
+    }
+    return buffer;
+}
+
+// Function to ask the kernel to start paging in buckets [bucketIndex, bucketIndex + count)
+// of one stripe ahead of their lookups; a no-op unless the mode is LOOKUP_MMAP_WILLNEED
+void plot_reader_willneed(const PlotReader *reader, unsigned long long bucketIndex, unsigned long long count)
+{
+    if (reader->mode != LOOKUP_MMAP_WILLNEED)
+    {
+        return;
+    }
+
+    const PlotStripes *stripes = &reader->stripes;
+    const uint8_t *map = (const uint8_t *)reader->maps[bucketIndex / stripes->stripe_buckets];
+    bucketIndex %= stripes->stripe_buckets;
+    long page_size = sysconf(_SC_PAGESIZE);
+
+    unsigned long long runs = stripes->layout.group_buckets == 1 ? 1 : stripes->layout.slices;
+    size_t run_bytes = count * (reader->records_in_bucket / runs) * sizeof(MemoRecord);
+    for (unsigned long long r = 0; r < runs; r++)
+    {
+        off_t offset = plot_slice_offset(&stripes->layout, bucketIndex, r);
+        off_t start = offset - offset % page_size;
+        madvise((void *)(map + start), run_bytes + (offset - start), MADV_WILLNEED);
+    }
+}
+
+// Function to look up a hash prefix of prefix_length bytes; returns the first nonce of
+// its bucket whose hash starts with the prefix, or -1. A bucket holds a few hundred
+// nonces, so they are hashed on the calling thread
+long long plot_reader_lookup(const PlotReader *reader, const uint8_t *prefix, size_t prefix_length, MemoRecord *buffer)
+{
+    // A sorted bucket of a mapped plot is searched in place, wherever its runs are
+    const PlotStripes *stripes = &reader->stripes;
+    if (reader->mode != LOOKUP_READ && (stripes->layout.flags & PLOT_FLAG_HASH_SORTED))
+    {
+        unsigned long long bucketIndex = getBucketIndex(prefix, PREFIX_SIZE);
+        const MemoRecord *map = reader->maps[bucketIndex / stripes->stripe_buckets];
+        bucketIndex %= stripes->stripe_buckets;
+        unsigned long long run_stride = stripes->layout.group_buckets * stripes->layout.records_in_slice;
+        return search_sorted_bucket(&map[plot_slice_offset(&stripes->layout, bucketIndex, 0) / sizeof(MemoRecord)], reader->records_in_bucket,
+                                    stripes->layout.records_in_slice, run_stride, prefix, prefix_length < BLAKE3_OUT_LEN ? prefix_length : BLAKE3_OUT_LEN);
+    }
+
+    const MemoRecord *records = plot_reader_bucket(reader, getBucketIndex(prefix, PREFIX_SIZE), buffer);
+    return plot_reader_match_bucket(reader, records, prefix, prefix_length);
+}
+
+// Function to order batch challenges by bucket, which is file offset order within a stripe
+int compare_lookup_challenges(const void *a, const void *b)
+{
+    const LookupChallenge *x = (const LookupChallenge *)a;
+    const LookupChallenge *y = (const LookupChallenge *)b;
+    if (x->bucket != y->bucket)
+        return x->bucket < y->bucket ? -1 : 1;
+    return x->index < y->index ? -1 : (x->index > y->index ? 1 : 0);
+}
+
+// Function to answer the challenges of one span of adjacent buckets, sorted by bucket:
+// the span is fetched with one read per run, or used in place when the plot is mapped,
+// and each bucket in it is hashed once for all the challenges that land in it
+void plot_reader_lookup_span(const PlotReader *reader, const LookupChallenge *challenges, size_t count,
+                             const uint8_t *prefixes, size_t prefix_stride, size_t hash_length,
+                             LookupScratch *scratch, long long *results)
+{
+    const PlotStripes *stripes = &reader->stripes;
+    const PlotLayout *layout = &stripes->layout;
+    unsigned long long first = challenges[0].bucket;
+    unsigned long long span_buckets = challenges[count - 1].bucket - first + 1;
+    int stripe = first / stripes->stripe_buckets;
+    unsigned long long local = first % stripes->stripe_buckets;
+
+    // In the classic layout the span is one contiguous range; in a grouped layout it
+    // lies within one group, so each of its runs is contiguous. Record i of bucket k
+    // of the span is at base[(i / records_in_slice) * run_stride + k * bucket_stride + i % records_in_slice]
+    bool classic = layout->group_buckets == 1;
+    const MemoRecord *base = scratch->records;
+    unsigned long long bucket_stride = classic ? reader->records_in_bucket : layout->records_in_slice;
+    unsigned long long run_stride = classic ? layout->records_in_slice : span_buckets * layout->records_in_slice;
+    if (reader->mode != LOOKUP_READ)
+    {
+        base = &reader->maps[stripe][plot_slice_offset(layout, local, 0) / sizeof(MemoRecord)];
+        if (!classic)
+        {
+            run_stride = layout->group_buckets * layout->records_in_slice;
+        }
+    }
+    else if (classic)
+    {
+        pread_fully(reader->fds[stripe], scratch->records, span_buckets * reader->records_in_bucket * sizeof(MemoRecord), plot_slice_offset(layout, local, 0));
+    }
+    else
+    {
+        for (unsigned long long r = 0; r < layout->slices; r++)
+        {
+            pread_fully(reader->fds[stripe], &scratch->records[r * run_stride],
+                        span_buckets * layout->records_in_slice * sizeof(MemoRecord), plot_slice_offset(layout, local, r));
+        }
+    }
+
+    // Sorted buckets are binary-searched per challenge instead of hashed whole
+    if (layout->flags & PLOT_FLAG_HASH_SORTED)
+    {
+        for (size_t c = 0; c < count; c++)
+        {
+            unsigned long long k = challenges[c].bucket - first;
+            results[challenges[c].index] = search_sorted_bucket(&base[k * bucket_stride], reader->records_in_bucket, layout->records_in_slice, run_stride,
+                                                                &prefixes[challenges[c].index * prefix_stride], hash_length);
+        }
+        return;
+    }
+
+    size_t c = 0;
+    while (c < count)
+    {
+        unsigned long long k = challenges[c].bucket - first;
+
+        // Hash the bucket's nonzero nonces once, in bucket order so that the first match
+        // is the same nonce plot_reader_lookup returns
+        size_t num_nonces = 0;
+        for (unsigned long long i = 0; i < reader->records_in_bucket; i++)
+        {
+            const MemoRecord *record = &base[(i / layout->records_in_slice) * run_stride + k * bucket_stride + i % layout->records_in_slice];
+            if (is_nonce_nonzero(record->nonce, NONCE_SIZE))
+            {
+                scratch->nonces[num_nonces++] = record->nonce;
+            }
+        }
+        blake3_hash_many_nonce(scratch->nonces, num_nonces, NONCE_SIZE, scratch->hashes, hash_length);
+
+        for (; c < count && challenges[c].bucket - first == k; c++)
+        {
+            const uint8_t *prefix = &prefixes[challenges[c].index * prefix_stride];
+            results[challenges[c].index] = -1;
+            for (size_t i = 0; i < num_nonces; i++)
+            {
+                if (memcmp(&scratch->hashes[i * hash_length], prefix, hash_length) == 0)
+                {
+                    results[challenges[c].index] = byteArrayToLongLong(scratch->nonces[i], NONCE_SIZE);
+                    break;
+                }
+            }
+        }
+    }
+}
+
+// Function to look up count hash prefixes of prefix_length bytes at once, the i-th
+// starting at prefixes + i * prefix_stride; results[i] receives what plot_reader_lookup
+// would return for it. The challenges are sorted by file offset and adjacent buckets
+// are merged into one read, so the plot is swept once in elevator order
+void plot_reader_lookup_batch(const PlotReader *reader, const uint8_t *prefixes, size_t prefix_stride, size_t prefix_length,
+                              size_t count, long long *results)
+{
+    const PlotStripes *stripes = &reader->stripes;
+    const PlotLayout *layout = &stripes->layout;
+    size_t hash_length = prefix_length < BLAKE3_OUT_LEN ? prefix_length : BLAKE3_OUT_LEN;
+    if (count == 0)
+    {
+        return;
+    }
+
+    LookupChallenge *challenges = (LookupChallenge *)malloc(count * sizeof(LookupChallenge));
+    size_t *spans = (size_t *)malloc((count + 1) * sizeof(size_t));
+    if (challenges == NULL || spans == NULL)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory.\n");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        challenges[i].bucket = getBucketIndex(&prefixes[i * prefix_stride], PREFIX_SIZE);
+        challenges[i].index = i;
+    }
+    qsort(challenges, count, sizeof(LookupChallenge), compare_lookup_challenges);
+
+    // Cut the sorted challenges into spans of adjacent buckets; a span stays within one
+    // stripe, within one group of a grouped layout and within IO_CHUNK_SIZE
+    size_t bucket_bytes = reader->records_in_bucket * sizeof(MemoRecord);
+    unsigned long long max_span_buckets = IO_CHUNK_SIZE / bucket_bytes > 0 ? IO_CHUNK_SIZE / bucket_bytes : 1;
+    size_t num_spans = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        unsigned long long bucket = challenges[i].bucket;
+        if (i > 0)
+        {
+            unsigned long long first = challenges[spans[num_spans - 1]].bucket;
+            unsigned long long previous = challenges[i - 1].bucket;
+            if (bucket == previous ||
+                (bucket == previous + 1 && bucket - first < max_span_buckets &&
+                 bucket / stripes->stripe_buckets == first / stripes->stripe_buckets &&
+                 (bucket % stripes->stripe_buckets) / layout->group_buckets == (first % stripes->stripe_buckets) / layout->group_buckets))
+            {
+                continue;
+            }
+        }
+        spans[num_spans++] = i;
+    }
+    spans[num_spans] = count;
+
+    // Threads take contiguous ranges of spans, so each one still reads in offset order
+#pragma omp parallel
+    {
+        LookupScratch scratch;
+        scratch.records = (MemoRecord *)malloc(max_span_buckets * bucket_bytes);
+        scratch.nonces = (const uint8_t **)malloc(reader->records_in_bucket * sizeof(uint8_t *));
+        scratch.hashes = (uint8_t *)malloc(reader->records_in_bucket * hash_length);
+        if (scratch.records == NULL || scratch.nonces == NULL || scratch.hashes == NULL)
+        {
+            fprintf(stderr, "Error: Unable to allocate memory.\n");
+            exit(EXIT_FAILURE);
+        }
+
+#pragma omp for schedule(static)
+        for (size_t s = 0; s < num_spans; s++)
+        {
+            if (s + LOOKUP_WILLNEED_AHEAD < num_spans)
+            {
+                const LookupChallenge *ahead = &challenges[spans[s + LOOKUP_WILLNEED_AHEAD]];
+                plot_reader_willneed(reader, ahead[0].bucket, challenges[spans[s + LOOKUP_WILLNEED_AHEAD + 1] - 1].bucket - ahead[0].bucket + 1);
+            }
+            plot_reader_lookup_span(reader, &challenges[spans[s]], spans[s + 1] - spans[s], prefixes, prefix_stride, hash_length, &scratch, results);
+        }
+
+        free(scratch.records);
+        free(scratch.nonces);
+        free(scratch.hashes);
+    }
+
+    free(spans);
+    free(challenges);
+}
+
+// Function to run lookups [first, last) of a batch through an io_uring of depth bucket reads:
+// a slot is refilled with the next lookup as soon as its bucket has been hashed, and
+// buckets are hashed as they complete while the reads of the others are still pending
+void lookup_ring(const PlotReader *reader, const uint8_t *prefixes, size_t prefix_stride, size_t prefix_length,
+                 size_t first, size_t last, unsigned depth, long long *results, double *latencies)
+{
+    IoQueue io;
+    MemoRecord *buffers = (MemoRecord *)malloc(depth * reader->records_in_bucket * sizeof(MemoRecord));
+    size_t *slot_lookup = (size_t *)malloc(depth * sizeof(size_t));
+    unsigned long long *slot_pending = (unsigned long long *)malloc(depth * sizeof(unsigned long long));
+    double *slot_start = (double *)malloc(depth * sizeof(double));
+    unsigned *free_slots = (unsigned *)malloc(depth * sizeof(unsigned));
+    if (buffers == NULL || slot_lookup == NULL || slot_pending == NULL || slot_start == NULL || free_slots == NULL ||
+        !io_queue_init(&io, IO_BACKEND_URING, depth))
+    {
+        fprintf(stderr, "Error: Unable to allocate memory.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    unsigned num_free = 0;
+    for (unsigned slot = depth; slot-- > 0;)
+    {
+        free_slots[num_free++] = slot;
+    }
+
+    size_t next = first;
+    while (next < last || num_free < depth)
+    {
+        while (num_free > 0 && next < last)
+        {
+            unsigned slot = free_slots[--num_free];
+            const uint8_t *prefix = &prefixes[next * prefix_stride];
+            slot_lookup[slot] = next++;
+            slot_start[slot] = omp_get_wtime();
+            slot_pending[slot] = plot_reader_queue_bucket(reader, &io, getBucketIndex(prefix, PREFIX_SIZE),
+                                                          &buffers[slot * reader->records_in_bucket], slot);
+        }
+
+        uint64_t tag;
+        if (!io_queue_wait(&io, &tag))
+        {
+            fprintf(stderr, "Error: lookup reads lost track of %u buckets in flight.\n", depth - num_free);
+            exit(EXIT_FAILURE);
+        }
+        if (--slot_pending[tag] > 0)
+        {
+            continue;
+        }
+
+        size_t i = slot_lookup[tag];
+        results[i] = plot_reader_match_bucket(reader, &buffers[tag * reader->records_in_bucket], &prefixes[i * prefix_stride], prefix_length);
+        latencies[i] = omp_get_wtime() - slot_start[tag];
+        free_slots[num_free++] = (unsigned)tag;
     }
 
-    return array;
+    io_queue_free(&io);
+    free(free_slots);
+    free(slot_start);
+    free(slot_pending);
+    free(slot_lookup);
+    free(buffers);
 }
 
-uint8_t *hexStringToByteArray(const char *hexString)
+// Function to order lookup latencies
+int compare_latencies(const void *a, const void *b)
 {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
 
-    size_t hexLen = strlen(hexString);
-    uint8_t *byteArray = (uint8_t *)malloc(hexLen * sizeof(uint8_t));
-    // size_t hexLen = strlen(hexString);
-    if (hexLen % 2 != 0)
+// Function to look up count hash prefixes like plot_reader_lookup_batch, but in arrival
+// order with queue_depth bucket reads kept in flight: through io_uring, one ring per
+// thread with the depth shared among them, or through a pool of queue_depth threads
+// each blocked in one read when io_uring is not available. Fills stats with the
+// sustained rate and the latency of each lookup from submission to result
+void plot_reader_lookup_async(const PlotReader *reader, const uint8_t *prefixes, size_t prefix_stride, size_t prefix_length,
+                              size_t count, IoBackendKind kind, unsigned queue_depth, long long *results, LookupStats *stats)
+{
+    double *latencies = (double *)malloc((count > 0 ? count : 1) * sizeof(double));
+    if (latencies == NULL)
     {
-        return NULL; // Error: Invalid hexadecimal string length
+        fprintf(stderr, "Error: Unable to allocate memory.\n");
+        exit(EXIT_FAILURE);
     }
 
-    size_t byteLen = hexLen / 2;
-    size_t byteArraySize = byteLen;
-    if (byteLen > byteArraySize)
+#ifdef HAVE_IO_URING
+    // A mapped plot is paged in by the threads touching it, never through a ring
+    if (reader->mode != LOOKUP_READ)
     {
-        return NULL; // Error: Byte array too small
+        kind = IO_BACKEND_SYNC;
     }
-
-    for (size_t i = 0; i < byteLen; ++i)
+    if (kind == IO_BACKEND_URING)
     {
-        if (sscanf(&hexString[i * 2], "%2hhx", &byteArray[i]) != 1)
+        IoQueue probe;
+        if (!io_queue_init(&probe, kind, 1))
         {
-            return NULL; // Error: Failed to parse hexadecimal string
+            fprintf(stderr, "Error: Unable to allocate memory for I/O requests.\n");
+            exit(EXIT_FAILURE);
         }
+        kind = probe.kind;
+        io_queue_free(&probe);
     }
+#else
+    kind = IO_BACKEND_SYNC;
+#endif
 
-    return byteArray;
-}
-
-long long search_memo_record(FILE *file, off_t bucketIndex, uint8_t *SEARCH_UINT8, size_t SEARCH_LENGTH, unsigned long long num_records_in_bucket_search, MemoRecord *buffer)
-{
-    const int HASH_SIZE_SEARCH = 8;
-    size_t records_read;
-    unsigned long long foundRecord = -1;
-    // Define the offset you want to seek to
-    long offset = bucketIndex * num_records_in_bucket_search * sizeof(MemoRecord); // For example, seek to byte 1024 from the beginning
-    if (DEBUG)
-        printf("SEARCH: seek to %zu offset\n", offset);
+    double start_time = omp_get_wtime();
 
-    // Seek to the specified offset
-    if (fseek(file, offset, SEEK_SET) != 0)
+    if (kind == IO_BACKEND_URING)
     {
-        perror("Error seeking in file");
-        fclose(file);
-        return -1;
+        // Every ring gets a contiguous share of the lookups and of the queue depth
+        int num_rings = omp_get_max_threads() < (int)queue_depth ? omp_get_max_threads() : (int)queue_depth;
+#pragma omp parallel num_threads(num_rings)
+        {
+            int ring = omp_get_thread_num();
+            int rings = omp_get_num_threads();
+            unsigned depth = queue_depth / rings + (ring < (int)(queue_depth % rings) ? 1 : 0);
+            size_t first = count * ring / rings;
+            size_t last = count * (ring + 1) / rings;
+            lookup_ring(reader, prefixes, prefix_stride, prefix_length, first, last, depth, results, latencies);
+        }
     }
-
-    records_read = fread(buffer, sizeof(MemoRecord), num_records_in_bucket_search, file);
-    if (records_read > 0)
+    else
     {
-        int found = 0; // Shared flag to indicate termination
-
-#pragma omp parallel shared(found)
+#pragma omp parallel num_threads(queue_depth)
         {
-#pragma omp for
-            for (size_t i = 0; i < records_read; ++i)
+            MemoRecord *buffer = (MemoRecord *)malloc(reader->records_in_bucket * sizeof(MemoRecord));
+            if (buffer == NULL)
             {
-                // Check for cancellation
-#pragma omp cancellation point for
-                if (!found && is_nonce_nonzero(buffer[i].nonce, NONCE_SIZE))
-                {
-                    uint8_t hash_output[HASH_SIZE_SEARCH];
-
-                    // Compute Blake3 hash of the nonce
-                    blake3_hasher hasher;
-                    blake3_hasher_init(&hasher);
-                    blake3_hasher_update(&hasher, buffer[i].nonce, NONCE_SIZE);
-                    blake3_hasher_finalize(&hasher, hash_output, HASH_SIZE_SEARCH);
-
-                    // print bucket contents
-                    if (DEBUG)
-                    {
-                        printf("bucket[");
-
-                        for (size_t n = 0; n < PREFIX_SIZE; ++n)
-                            printf("%02X", SEARCH_UINT8[n]);
-                        printf("][%zu] = ", i);
-
-                        for (size_t n = 0; n < NONCE_SIZE; ++n)
-                            printf("%02X", buffer[i].nonce[n]);
-                        printf(" => ");
-                        for (size_t n = 0; n < HASH_SIZE_SEARCH; ++n)
-                            printf("%02X", hash_output[n]);
-                        printf("\n");
-                    }
-
-                    // Compare the first PREFIX_SIZE bytes of the current hash to the previous hash prefix
-                    if (memcmp(hash_output, SEARCH_UINT8, SEARCH_LENGTH) == 0)
-                    {
-                        foundRecord = byteArrayToLongLong(buffer[i].nonce, NONCE_SIZE);
-
-#pragma omp atomic write
-                        found = 1;
+                fprintf(stderr, "Error: Unable to allocate memory.\n");
+                exit(EXIT_FAILURE);
+            }
 
-#pragma omp cancel for
-                    }
-                    else
-                    {
-                        //++count_condition_not_met;
-
-                        /*
-                                            if (!DEBUG)
-                                            {
-                                            // Print previous hash and nonce, and current hash and nonce
-                                            //printf("Condition not met at record %zu:\n", total_records);
-                                            //printf("Search string %s\n",SEARCH_STRING);
-
-                                            printf("Search hash prefix (UINT8): ");
-                                            for (size_t n = 0; n < PREFIX_SIZE; ++n)
-                                                printf("%02X", SEARCH_UINT8[n]);
-                                            printf("\n");
-
-                                            printf("Current nonce: ");
-                                            for (size_t n = 0; n < NONCE_SIZE; ++n)
-                                                printf("%02X", buffer[i].nonce[n]);
-                                            printf("\n");
-                                            printf("Current hash prefix: ");
-                                            for (size_t n = 0; n < HASH_SIZE_SEARCH; ++n)
-                                                printf("%02X", hash_output[n]);
-                                            printf("\n");
-                                            }
-                                            */
-                    }
+#pragma omp for schedule(dynamic, 1)
+            for (size_t i = 0; i < count; i++)
+            {
+                if (i + queue_depth * LOOKUP_WILLNEED_AHEAD < count)
+                {
+                    plot_reader_willneed(reader, getBucketIndex(&prefixes[(i + queue_depth * LOOKUP_WILLNEED_AHEAD) * prefix_stride], PREFIX_SIZE), 1);
                 }
+                double lookup_start = omp_get_wtime();
+                results[i] = plot_reader_lookup(reader, &prefixes[i * prefix_stride], prefix_length, buffer);
+                latencies[i] = omp_get_wtime() - lookup_start;
             }
+
+            free(buffer);
         }
     }
-    else
+
+    stats->seconds = omp_get_wtime() - start_time;
+    stats->backend = kind;
+    stats->queue_depth = queue_depth;
+    stats->mean_us = stats->p50_us = stats->p99_us = stats->max_us = 0;
+    if (count > 0)
     {
-        printf("error reading from file..\n");
+        double total = 0;
+        for (size_t i = 0; i < count; i++)
+        {
+            total += latencies[i];
+        }
+        qsort(latencies, count, sizeof(double), compare_latencies);
+        stats->mean_us = total / count * 1e6;
+        stats->p50_us = latencies[count / 2] * 1e6;
+        stats->p99_us = latencies[(count * 99) / 100] * 1e6;
+        stats->max_us = latencies[count - 1] * 1e6;
     }
-    return foundRecord;
+    free(latencies);
 }
 
 // not sure if the search of more than PREFIX_LENGTH works
@@ -629,23 +3496,17 @@ void search_memo_records(const char *filename, const char *SEARCH_STRING)
 {
     uint8_t *SEARCH_UINT8 = hexStringToByteArray(SEARCH_STRING);
     size_t SEARCH_LENGTH = strlen(SEARCH_STRING) / 2;
-    off_t bucketIndex = getBucketIndex(SEARCH_UINT8, PREFIX_SIZE);
-    // uint8_t *SEARCH_UINT8 = convert_string_to_uint8_array(SEARCH_STRING);
-    // num_records_in_bucket
     MemoRecord *buffer = NULL;
-    // size_t total_records = 0;
-    // size_t zero_nonce_count = 0;
-
-    FILE *file = NULL;
-    // uint8_t prev_hash[PREFIX_SIZE] = {0}; // Initialize previous hash prefix to zero
-    // uint8_t prev_nonce[NONCE_SIZE] = {0}; // Initialize previous nonce to zero
-    // size_t count_condition_met = 0;       // Counter for records meeting the condition
-    // size_t count_condition_not_met = 0;
     bool foundRecord = false;
-    // MemoRecord fRecord;
     long long fRecord = -1;
 
-    long filesize = get_file_size(filename);
+    PlotReader reader;
+    if (!plot_reader_open(&reader, filename, LOOKUP_MODE))
+    {
+        return;
+    }
+
+    long filesize = get_plot_size(&reader.stripes);
 
     if (filesize != -1)
     {
@@ -654,40 +3515,29 @@ void search_memo_records(const char *filename, const char *SEARCH_STRING)
     }
 
     unsigned long long num_buckets_search = 1ULL << (PREFIX_SIZE * 8);
-    unsigned long long num_records_in_bucket_search = filesize / num_buckets_search / sizeof(MemoRecord);
     if (!BENCHMARK)
     {
         printf("SEARCH: filename=%s\n", filename);
         printf("SEARCH: filesize=%zu\n", filesize);
         printf("SEARCH: num_buckets=%lluu\n", num_buckets_search);
-        printf("SEARCH: num_records_in_bucket=%llu\n", num_records_in_bucket_search);
+        printf("SEARCH: num_records_in_bucket=%llu\n", reader.records_in_bucket);
+        printf("SEARCH: lookup_mode=%s\n", lookup_mode_name(reader.mode));
         printf("SEARCH: SEARCH_STRING=%s\n", SEARCH_STRING);
     }
 
-    // Open the file for reading in binary mode
-    file = fopen(filename, "rb");
-    if (file == NULL)
-    {
-        printf("Error opening file %s (#3)\n", filename);
-
-        perror("Error opening file");
-        return;
-    }
-
-    // Allocate memory for the batch of MemoRecords
-    buffer = (MemoRecord *)malloc(num_records_in_bucket_search * sizeof(MemoRecord));
+    // Allocate memory for the bucket's MemoRecords
+    buffer = (MemoRecord *)malloc(reader.records_in_bucket * sizeof(MemoRecord));
     if (buffer == NULL)
     {
         fprintf(stderr, "Error: Unable to allocate memory.\n");
-        fclose(file);
+        plot_reader_close(&reader);
         return;
     }
 
     // Start walltime measurement
     double start_time = omp_get_wtime();
-    // double end_time = omp_get_wtime();
 
-    fRecord = search_memo_record(file, bucketIndex, SEARCH_UINT8, SEARCH_LENGTH, num_records_in_bucket_search, buffer);
+    fRecord = plot_reader_lookup(&reader, SEARCH_UINT8, SEARCH_LENGTH, buffer);
     if (fRecord >= 0)
         foundRecord = true;
     else
@@ -695,15 +3545,10 @@ void search_memo_records(const char *filename, const char *SEARCH_STRING)
 
     double elapsed_time = (omp_get_wtime() - start_time) * 1000.0;
 
-    // Check for reading errors
-    if (ferror(file))
-    {
-        perror("Error reading file");
-    }
-
     // Clean up
-    fclose(file);
     free(buffer);
+    free(SEARCH_UINT8);
+    plot_reader_close(&reader);
 
     // Print the total number of times the condition was met
     if (foundRecord == true)
@@ -711,8 +3556,6 @@ void search_memo_records(const char *filename, const char *SEARCH_STRING)
     else
         printf("no NONCE found for HASH prefix %s\n", SEARCH_STRING);
     printf("search time %.2f ms\n", elapsed_time);
-
-    // return NULL;
 }
 
 // not sure if the search of more than PREFIX_LENGTH works
@@ -721,25 +3564,17 @@ void search_memo_records_batch(const char *filename, int num_lookups, int search
     // Seed the random number generator with the current time
     srand((unsigned int)time(NULL));
 
-    // uint8_t *SEARCH_UINT8 = hexStringToByteArray("000000");
     size_t SEARCH_LENGTH = search_size;
-    // uint8_t *SEARCH_UINT8 = convert_string_to_uint8_array(SEARCH_STRING);
-    // num_records_in_bucket
-    MemoRecord *buffer = NULL;
-    // size_t total_records = 0;
-    // size_t zero_nonce_count = 0;
-
-    FILE *file = NULL;
-    // uint8_t prev_hash[PREFIX_SIZE] = {0}; // Initialize previous hash prefix to zero
-    // uint8_t prev_nonce[NONCE_SIZE] = {0}; // Initialize previous nonce to zero
-    // size_t count_condition_met = 0;       // Counter for records meeting the condition
-    // size_t count_condition_not_met = 0;
     int foundRecords = 0;
     int notFoundRecords = 0;
-    // MemoRecord fRecord;
-    // long long fRecord = -1;
 
-    long filesize = get_file_size(filename);
+    PlotReader reader;
+    if (!plot_reader_open(&reader, filename, LOOKUP_MODE))
+    {
+        return;
+    }
+
+    long filesize = get_plot_size(&reader.stripes);
 
     if (filesize != -1)
     {
@@ -748,250 +3583,621 @@ void search_memo_records_batch(const char *filename, int num_lookups, int search
     }
 
     unsigned long long num_buckets_search = 1ULL << (PREFIX_SIZE * 8);
-    unsigned long long num_records_in_bucket_search = filesize / num_buckets_search / sizeof(MemoRecord);
+    unsigned long long num_records_in_bucket_search = reader.records_in_bucket;
     if (!BENCHMARK)
     {
         printf("SEARCH: filename=%s\n", filename);
         printf("SEARCH: filesize=%zu\n", filesize);
         printf("SEARCH: num_buckets=%llu\n", num_buckets_search);
         printf("SEARCH: num_records_in_bucket=%llu\n", num_records_in_bucket_search);
+        printf("SEARCH: lookup_mode=%s\n", lookup_mode_name(reader.mode));
     }
-    // printf("SEARCH: SEARCH_STRING=%s\n",SEARCH_STRING);
 
-    // Open the file for reading in binary mode
-    file = fopen(filename, "rb");
-    if (file == NULL)
+    // The random prefixes are drawn up front, rand() is not thread-safe; each is at
+    // least PREFIX_SIZE bytes long, which the bucket index is taken from
+    size_t prefix_stride = SEARCH_LENGTH > PREFIX_SIZE ? SEARCH_LENGTH : PREFIX_SIZE;
+    uint8_t *prefixes = (uint8_t *)malloc(num_lookups * prefix_stride);
+    if (prefixes == NULL)
     {
-        printf("Error opening file %s (#3)\n", filename);
-
-        perror("Error opening file");
+        fprintf(stderr, "Error: Unable to allocate memory.\n");
+        plot_reader_close(&reader);
         return;
     }
+    for (size_t i = 0; i < num_lookups * prefix_stride; ++i)
+    {
+        prefixes[i] = rand() % 256;
+    }
 
-    // Allocate memory for the batch of MemoRecords
-    buffer = (MemoRecord *)malloc(num_records_in_bucket_search * sizeof(MemoRecord));
-    if (buffer == NULL)
+    long long *results = (long long *)malloc(num_lookups * sizeof(long long));
+    if (results == NULL)
     {
         fprintf(stderr, "Error: Unable to allocate memory.\n");
-        fclose(file);
+        free(prefixes);
+        plot_reader_close(&reader);
         return;
     }
 
     // Start walltime measurement
     double start_time = omp_get_wtime();
-    // double end_time = omp_get_wtime();
 
-    uint8_t SEARCH_UINT8[search_size];
+    LookupStats stats;
+    if (LOOKUP_DEPTH > 0)
+        plot_reader_lookup_async(&reader, prefixes, prefix_stride, SEARCH_LENGTH, num_lookups, IO_BACKEND, LOOKUP_DEPTH, results, &stats);
+    else
+        plot_reader_lookup_batch(&reader, prefixes, prefix_stride, SEARCH_LENGTH, num_lookups, results);
+
+    double elapsed_time = (omp_get_wtime() - start_time) * 1000.0;
 
     for (int i = 0; i < num_lookups; i++)
     {
-
-        for (int i = 0; i < search_size; ++i)
-        {
-            SEARCH_UINT8[i] = rand() % 256;
-        }
-
-        if (search_memo_record(file, getBucketIndex(SEARCH_UINT8, PREFIX_SIZE), SEARCH_UINT8, SEARCH_LENGTH, num_records_in_bucket_search, buffer) >= 0)
+        if (results[i] >= 0)
             foundRecords++;
         else
             notFoundRecords++;
     }
 
-    double elapsed_time = (omp_get_wtime() - start_time) * 1000.0;
-
-    // Check for reading errors
-    if (ferror(file))
-    {
-        perror("Error reading file");
-    }
-
     // Clean up
-    fclose(file);
-    free(buffer);
+    free(results);
+    free(prefixes);
+    plot_reader_close(&reader);
 
-    // Print the total number of times the condition was met
-    // if (foundRecord == true)
-    //	printf("NONCE found (%zu) for HASH prefix %s\n",fRecord,SEARCH_STRING);
-    // else
-    //	printf("no NONCE found for HASH prefix %s\n",SEARCH_STRING);
     if (!BENCHMARK)
+    {
         printf("searched for %d lookups of %d bytes long, found %d, not found %d in %.2f seconds, %.4f ms per lookup\n", num_lookups, search_size, foundRecords, notFoundRecords, elapsed_time / 1000.0, elapsed_time / num_lookups);
+        if (LOOKUP_DEPTH > 0)
+            printf("async lookups (%s, queue depth %u): %.0f lookups/s, latency mean %.1f us, p50 %.1f us, p99 %.1f us, max %.1f us\n",
+                   reader.mode != LOOKUP_READ ? lookup_mode_name(reader.mode) : io_backend_name(stats.backend), stats.queue_depth, num_lookups / stats.seconds, stats.mean_us, stats.p50_us, stats.p99_us, stats.max_us);
+    }
     else
         printf("%s %d %zu %llu %llu %d %d %d %d %.2f %.2f\n", filename, NUM_THREADS, filesize, num_buckets_search, num_records_in_bucket_search, num_lookups, search_size, foundRecords, notFoundRecords, elapsed_time / 1000.0, elapsed_time / num_lookups);
-    // return NULL;
 }
 
-uint64_t largest_power_of_two_less_than(uint64_t number)
+// Function to get the peak resident set size of the process in bytes
+unsigned long long get_peak_rss_bytes()
 {
-    if (number == 0)
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
     {
         return 0;
     }
+#ifdef __APPLE__
+    return usage.ru_maxrss; // bytes on macOS
+#else
+    return usage.ru_maxrss * 1024ULL; // kilobytes on Linux
+#endif
+}
 
-    // Decrement number to handle cases where number is already a power of 2
-    number--;
+// Function to get the physical memory currently free, in bytes
+unsigned long long get_available_memory_bytes()
+{
+#ifdef _SC_AVPHYS_PAGES
+    long pages = sysconf(_SC_AVPHYS_PAGES);
+#else
+    long pages = sysconf(_SC_PHYS_PAGES); // macOS only reports the installed memory
+#endif
+    long page_size = sysconf(_SC_PAGESIZE);
+    if (pages < 0 || page_size < 0)
+    {
+        return 0;
+    }
+    return (unsigned long long)pages * page_size;
+}
 
-    // Set all bits to the right of the most significant bit
-    number |= number >> 1;
-    number |= number >> 2;
-    number |= number >> 4;
-    number |= number >> 8;
-    number |= number >> 16;
-    number |= number >> 32; // Only needed for 64-bit integers
+int rename_file(const char *old_name, const char *new_name)
+{
+    // Attempt to rename the file
+    if (rename(old_name, new_name) != 0)
+    {
+        // If rename fails, perror prints a descriptive error message
+        perror("Error renaming file");
+        return -1;
+    }
+
+    // Success
+    return 0;
+}
+
+void remove_file(const char *fileName)
+{
+    // Attempt to remove the file
+    if (remove(fileName) == 0)
+    {
+        if (DEBUG)
+            printf("File '%s' removed successfully.\n", fileName);
+    }
+    else
+    {
+        perror("Error removing file");
+    }
+}
+
+int move_file_overwrite(const char *source_path, const char *destination_path)
+{
+    if (DEBUG)
+        printf("move_file_overwrite()...\n");
+    // Attempt to rename the file
+    if (rename(source_path, destination_path) == 0)
+    {
+        if (!BENCHMARK)
+            printf("rename success!\n");
+        return 0;
+    }
+
+    // If rename failed, check if it's due to cross-device move
+    if (errno != EXDEV)
+    {
+        perror("Error renaming file");
+        return -1;
+    }
+
+    // Proceed to copy and delete since it's a cross-filesystem move
+    double start_time = omp_get_wtime();
+
+    // Remove the destination file if it exists to allow overwriting
+    if (remove(destination_path) != 0 && errno != ENOENT)
+    {
+        perror("Error removing existing destination file");
+        return -1;
+    }
+
+    int fd_src = open(source_path, O_RDONLY);
+    if (fd_src < 0)
+    {
+        perror("Error opening source file for reading");
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd_src, &st) != 0)
+    {
+        perror("Error getting source file size");
+        close(fd_src);
+        return -1;
+    }
+    off_t size = st.st_size;
+
+    int fd_dest = open(destination_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd_dest < 0)
+    {
+        perror("Error opening destination file for writing");
+        close(fd_src);
+        return -1;
+    }
+
+    // Reserve the whole destination up front so the chunks, which land in any
+    // order, do not fragment it
+    preallocate_file(fd_dest, size, destination_path);
+    advise_file(fd_src, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    if (!BENCHMARK)
+        printf("deep copy started...\n");
+
+    // Chunks are copied in parallel with explicit offsets; copy_file_range keeps
+    // the data in the kernel, and where it is not supported across these file
+    // systems each thread falls back to positional reads and writes
+    unsigned long long num_chunks = (size + COPY_CHUNK_SIZE - 1) / COPY_CHUNK_SIZE;
+    bool kernel_copy = true;
+    WritebackGovernor writeback;
+    writeback_init(&writeback, fd_dest);
+#pragma omp parallel
+    {
+        uint8_t *buffer = NULL;
+        // Other threads clear kernel_copy while this one may be starting up
+        bool use_kernel_copy;
+#pragma omp atomic read
+        use_kernel_copy = kernel_copy;
+
+#pragma omp for schedule(dynamic)
+        for (unsigned long long c = 0; c < num_chunks; c++)
+        {
+            off_t offset = c * COPY_CHUNK_SIZE;
+            size_t remaining = size - offset < (off_t)COPY_CHUNK_SIZE ? (size_t)(size - offset) : COPY_CHUNK_SIZE;
+            size_t chunk_bytes = remaining;
+
+#if defined(__linux__)
+            while (use_kernel_copy && remaining > 0)
+            {
+                off_t offset_in = offset;
+                off_t offset_out = offset;
+                ssize_t copied = copy_file_range(fd_src, &offset_in, fd_dest, &offset_out, remaining, 0);
+                if (copied < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+                if (copied <= 0)
+                {
+                    if (copied < 0 && errno != EXDEV && errno != ENOSYS && errno != EOPNOTSUPP && errno != EINVAL)
+                    {
+                        perror("Error copying file");
+                        exit(EXIT_FAILURE);
+                    }
+                    use_kernel_copy = false;
+#pragma omp atomic write
+                    kernel_copy = false;
+                    break;
+                }
+                offset += copied;
+                remaining -= copied;
+            }
+#else
+            use_kernel_copy = false;
+#pragma omp atomic write
+            kernel_copy = false;
+#endif
+
+            if (remaining > 0)
+            {
+                if (buffer == NULL)
+                {
+                    buffer = (uint8_t *)malloc(IO_CHUNK_SIZE);
+                    if (buffer == NULL)
+                    {
+                        perror("Failed to allocate memory");
+                        exit(EXIT_FAILURE);
+                    }
+                }
+                while (remaining > 0)
+                {
+                    size_t chunk = remaining < IO_CHUNK_SIZE ? remaining : IO_CHUNK_SIZE;
+                    pread_fully(fd_src, buffer, chunk, offset);
+                    pwrite_fully(fd_dest, buffer, chunk, offset);
+                    offset += chunk;
+                    remaining -= chunk;
+                }
+            }
+
+            writeback_range(&writeback, c * COPY_CHUNK_SIZE, chunk_bytes);
+        }
+
+        free(buffer);
+    }
 
-    // The most significant bit is now set; shift right to get the largest power of 2 less than the original number
-    return (number + 1) >> 1;
-}
+    close(fd_src);
 
-int rename_file(const char *old_name, const char *new_name)
-{
-    // Attempt to rename the file
-    if (rename(old_name, new_name) != 0)
+    // The source is removed next, so the copy has to be durable first
+    writeback_finish(&writeback);
+    if (sync_file_data(fd_dest) != 0)
     {
-        // If rename fails, perror prints a descriptive error message
-        perror("Error renaming file");
+        perror("Failed to fsync buffer");
+        close(fd_dest);
+        return EXIT_FAILURE;
+    }
+
+    close(fd_dest);
+
+    if (remove(source_path) != 0)
+    {
+        perror("Error deleting source file after moving");
         return -1;
     }
 
-    // Success
-    return 0;
+    double elapsed_time = omp_get_wtime() - start_time;
+    if (!BENCHMARK)
+        printf("Cross-Device Copy: %.2f MB/s, %.2f seconds (%s)\n", size / (elapsed_time * 1024 * 1024), elapsed_time, kernel_copy ? "copy_file_range" : "pread/pwrite");
+
+    if (!BENCHMARK)
+        printf("deep copy finished!\n");
+    if (DEBUG)
+        printf("move_file_overwrite() finished!\n");
+    return 0; // Success
 }
 
-void remove_file(const char *fileName)
+// Function to split slices into exactly passes factors of at least 2 with the smallest
+// sum, which the number of reads of a multi-pass shuffle is proportional to; returns
+// the sum, or 0 if slices has no such factorization
+unsigned long long shuffle_factors(unsigned long long slices, int passes, unsigned long long *factors)
 {
-    // Attempt to remove the file
-    if (remove(fileName) == 0)
+    if (passes == 1)
     {
-        if (DEBUG)
-            printf("File '%s' removed successfully.\n", fileName);
+        factors[0] = slices;
+        return slices >= 2 ? slices : 0;
     }
-    else
+
+    unsigned long long best = 0;
+    unsigned long long rest[SHUFFLE_MAX_PASSES];
+    for (unsigned long long d = 2; d * d <= slices; d++)
     {
-        perror("Error removing file");
+        if (slices % d != 0)
+        {
+            continue;
+        }
+        unsigned long long sum = shuffle_factors(slices / d, passes - 1, rest);
+        if (sum > 0 && (best == 0 || d + sum < best))
+        {
+            best = d + sum;
+            factors[0] = d;
+            memcpy(&factors[1], rest, (passes - 1) * sizeof(unsigned long long));
+        }
     }
+    return best;
 }
 
-int move_file_overwrite(const char *source_path, const char *destination_path)
+// Function to predict the time of a shuffle plan: every pass reads and writes the
+// whole file, and every read or write of a group pays one seek
+double shuffle_cost(ShufflePlan *plan, unsigned long long file_bytes, unsigned long long buffer_bytes)
 {
-    if (DEBUG)
-        printf("move_file_overwrite()...\n");
-    // Attempt to rename the file
-    if (rename(source_path, destination_path) == 0)
+    double seconds = 0.0;
+    plan->min_read_bytes = buffer_bytes;
+    for (int i = 0; i < plan->num_passes; i++)
     {
-        if (!BENCHMARK)
-            printf("rename success!\n");
-        return 0;
+        unsigned long long read_bytes = buffer_bytes / plan->factors[i];
+        double num_ios = (double)file_bytes / read_bytes + (double)file_bytes / buffer_bytes;
+        seconds += num_ios * SEEK_TIME_MS / 1000.0 + 2.0 * file_bytes / (DISK_BANDWIDTH_MBPS * 1024 * 1024);
+        if (read_bytes < plan->min_read_bytes)
+        {
+            plan->min_read_bytes = read_bytes;
+        }
     }
+    return seconds;
+}
 
-    // If rename failed, check if it's due to cross-device move
-    if (errno != EXDEV)
+// Function to choose the number of shuffle passes: the cheapest plan whose reads are
+// all at least SHUFFLE_MIN_READ_KB, or failing that the plan with the largest reads
+void plan_shuffle(ShufflePlan *plan, unsigned long long file_bytes, unsigned long long memory_bytes)
+{
+    unsigned long long num_buffers = SHUFFLE_IN_PLACE ? SHUFFLE_RING_SLOTS : 2 * SHUFFLE_RING_SLOTS;
+    unsigned long long buffer_bytes = memory_bytes / num_buffers;
+    bool have_plan = false;
+    bool feasible = false;
+
+    for (int passes = 1; passes <= SHUFFLE_MAX_PASSES; passes++)
     {
-        perror("Error renaming file");
-        return -1;
-    }
+        ShufflePlan candidate;
+        candidate.num_passes = passes;
+        if (shuffle_factors(rounds, passes, candidate.factors) == 0)
+        {
+            continue;
+        }
+        candidate.predicted_seconds = shuffle_cost(&candidate, file_bytes, buffer_bytes);
+        if (passes == 1)
+        {
+            plan->single_pass_seconds = candidate.predicted_seconds;
+        }
+        if (SHUFFLE_PASSES > 0 && passes != SHUFFLE_PASSES)
+        {
+            continue;
+        }
 
-    // Proceed to copy and delete since it's a cross-filesystem move
+        bool candidate_feasible = candidate.min_read_bytes >= SHUFFLE_MIN_READ_KB * 1024;
+        bool better;
+        if (!have_plan)
+            better = true;
+        else if (candidate_feasible != feasible)
+            better = candidate_feasible;
+        else if (feasible)
+            better = candidate.predicted_seconds < plan->predicted_seconds;
+        else
+            better = candidate.min_read_bytes > plan->min_read_bytes;
 
-    // Remove the destination file if it exists to allow overwriting
-    if (remove(destination_path) != 0 && errno != ENOENT)
-    {
-        perror("Error removing existing destination file");
-        return -1;
+        if (better)
+        {
+            double single_pass_seconds = plan->single_pass_seconds;
+            *plan = candidate;
+            plan->single_pass_seconds = single_pass_seconds;
+            have_plan = true;
+            feasible = candidate_feasible;
+        }
     }
 
-    // Continue with copying as in the original move_file function
-    FILE *source = fopen(source_path, "rb");
-    if (source == NULL)
+    // A forced pass count that rounds cannot be split into falls back to one pass
+    if (!have_plan)
     {
-        perror("Error opening source file for reading");
-        return -1;
+        plan->num_passes = 1;
+        plan->factors[0] = rounds;
+        plan->predicted_seconds = shuffle_cost(plan, file_bytes, buffer_bytes);
+        plan->single_pass_seconds = plan->predicted_seconds;
     }
+}
 
-    FILE *destination = fopen(destination_path, "wb");
-    if (destination == NULL)
+// Function to run one shuffle pass: every slices adjacent slices of the source file,
+// with slice_records records per bucket each, are merged into one destination slice;
+// the files hold stripe_buckets buckets, those of stripe stripe of a striped plot;
+// returns the walltime of the pass
+double shuffle_pass(const char *src_name, const char *dest_name, unsigned long long num_slices, unsigned long long slices, unsigned long long slice_records,
+                    unsigned long long memory_bytes, int num_threads_io, double start_time, int pass, int num_passes,
+                    unsigned long long stripe_buckets, int stripe)
+{
+    // Open the source for reading
+    int fd_src = open(src_name, O_RDONLY);
+    if (fd_src < 0)
     {
-        perror("Error opening destination file for writing");
-        fclose(source);
-        return -1;
+        printf("Error opening file %s (#7)\n", src_name);
+        perror("Error opening file");
+        exit(EXIT_FAILURE);
     }
 
-    if (!BENCHMARK)
-        printf("deep copy started...\n");
-    size_t buffer_size = 1024 * 1024 * 8; // 1 MB
-    uint8_t *buffer = (uint8_t *)calloc(buffer_size, 1);
+    // Open the destination for writing
+    int fd_dest = open(dest_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd_dest < 0)
+    {
+        printf("Error opening file %s (#5)\n", dest_name);
+        perror("Error opening file");
+        exit(EXIT_FAILURE);
+    }
 
-    if (buffer == NULL)
+    // The destination is exactly as large as the source
+    struct stat st;
+    if (fstat(fd_src, &st) != 0)
     {
-        perror("Failed to allocate memory");
-        return EXIT_FAILURE;
+        perror("Error getting file size");
+        exit(EXIT_FAILURE);
     }
+    preallocate_file(fd_dest, st.st_size, dest_name);
 
-    // char buffer[1024*1024];
-    size_t bytes;
+    unsigned long long num_buckets_to_read = shuffle_group_buckets(memory_bytes, slices * slice_records, stripe_buckets);
 
-    while ((bytes = fread(buffer, 1, sizeof(buffer), source)) > 0)
+    // Calculate the total number of records to read per batch
+    size_t records_per_batch = slice_records * num_buckets_to_read;
+    // Calculate the size of the buffer needed
+    size_t buffer_size = records_per_batch * slices;
+    // Allocate the rings as huge page arenas, the transpose touches all of them
+    ShufflePipeline pipeline;
+    for (int slot = 0; slot < SHUFFLE_RING_SLOTS; slot++)
     {
-        size_t bytes_written = fwrite(buffer, 1, bytes, destination);
-        if (bytes_written != bytes)
+        if (DEBUG)
+            printf("allocating 2 x %lu bytes for ring slot %d\n", buffer_size * sizeof(MemoRecord), slot);
+        bool huge_pages;
+        pipeline.input[slot] = (MemoRecord *)allocate_arena(buffer_size * sizeof(MemoRecord), &pipeline.arena_size, &huge_pages);
+        if (SHUFFLE_IN_PLACE)
+            pipeline.output[slot] = pipeline.input[slot];
+        else
+            pipeline.output[slot] = (MemoRecord *)allocate_arena(buffer_size * sizeof(MemoRecord), &pipeline.arena_size, &huge_pages);
+        if (pipeline.input[slot] == NULL || pipeline.output[slot] == NULL)
         {
-            perror("Error writing to destination file");
-            fclose(source);
-            fclose(destination);
-            return -1;
+            fprintf(stderr, "Error allocating memory for shuffle buffers.\n");
+            exit(EXIT_FAILURE);
         }
     }
 
-    if (ferror(source))
+    pipeline.in_place = SHUFFLE_IN_PLACE;
+    pipeline.fd_src = fd_src;
+    pipeline.fd_dest = fd_dest;
+    writeback_init(&pipeline.writeback, fd_dest);
+    pipeline.num_threads_io = num_threads_io > 0 ? num_threads_io : omp_get_max_threads();
+    pipeline.slices = slices;
+    pipeline.slice_records = slice_records;
+    pipeline.num_buckets_to_read = num_buckets_to_read;
+    pipeline.stripe = stripe;
+    pipeline.num_buckets = stripe_buckets;
+    pipeline.num_groups = stripe_buckets / num_buckets_to_read;
+    pipeline.records_per_batch = records_per_batch;
+    pipeline.buffer_size = buffer_size;
+    pipeline.start_time = start_time;
+    pipeline.pass = pass;
+    pipeline.num_passes = num_passes;
+    pipeline.groups_in_pass = num_slices / slices * pipeline.num_groups;
+    pipeline.elapsed_time_read_total = 0.0;
+    pipeline.elapsed_time_transpose_total = 0.0;
+    pipeline.elapsed_time_write_total = 0.0;
+
+    double start_time_pass = omp_get_wtime();
+    for (unsigned long long dest_slice = 0; dest_slice < num_slices / slices; dest_slice++)
     {
-        perror("Error reading from source file");
-        fclose(source);
-        fclose(destination);
-        return -1;
+        pipeline.first_slice = dest_slice * slices;
+        pipeline.dest_slice = dest_slice;
+        pipeline.groups_done = dest_slice * pipeline.num_groups;
+        run_shuffle_pipeline(&pipeline);
     }
+    double elapsed_time_pass = omp_get_wtime() - start_time_pass;
 
-    if (fflush(source) != 0)
+    if (!BENCHMARK)
     {
-        perror("Failed to flush buffer");
-        fclose(source);
-        return EXIT_FAILURE;
+        char label[64] = "Shuffle Phases";
+        if (num_passes > 1)
+            snprintf(label, sizeof(label), "Shuffle Pass %d/%d Phases", pass + 1, num_passes);
+        if (stripe >= 0)
+        {
+            char stripe_label[64];
+            snprintf(stripe_label, sizeof(stripe_label), "Stripe %d %s", stripe, label);
+            strcpy(label, stripe_label);
+        }
+        double total_mb = buffer_size * sizeof(MemoRecord) * pipeline.groups_in_pass / (1024 * 1024.0);
+        if (pipeline.in_place)
+            printf("%s: scatter read %.2f s (%.2f MB/s), write %.2f s (%.2f MB/s), %.2f s wall\n", label,
+                   pipeline.elapsed_time_read_total, total_mb / pipeline.elapsed_time_read_total,
+                   pipeline.elapsed_time_write_total, total_mb / pipeline.elapsed_time_write_total,
+                   elapsed_time_pass);
+        else
+            printf("%s: read %.2f s (%.2f MB/s), transpose %.2f s (%.2f MB/s), write %.2f s (%.2f MB/s), %.2f s wall\n", label,
+                   pipeline.elapsed_time_read_total, total_mb / pipeline.elapsed_time_read_total,
+                   pipeline.elapsed_time_transpose_total, total_mb / pipeline.elapsed_time_transpose_total,
+                   pipeline.elapsed_time_write_total, total_mb / pipeline.elapsed_time_write_total,
+                   elapsed_time_pass);
     }
 
-    if (fsync(fileno(source)) != 0)
+    // The final file is made durable once at the end, intermediate files never need to be
+    close(fd_src);
+    writeback_finish(&pipeline.writeback);
+    close(fd_dest);
+
+    for (int slot = 0; slot < SHUFFLE_RING_SLOTS; slot++)
     {
-        perror("Failed to fsync buffer");
-        fclose(source);
-        return EXIT_FAILURE;
+        munmap(pipeline.input[slot], pipeline.arena_size);
+        if (!pipeline.in_place)
+            munmap(pipeline.output[slot], pipeline.arena_size);
     }
 
-    fclose(source);
+    return elapsed_time_pass;
+}
+
+// Function to run every pass of the shuffle plan over one temporary file; every pass
+// but the last writes an intermediate file next to the temporary file, and each
+// source is removed once its pass is on disk
+void *shuffle_stripe(void *arg)
+{
+    StripeShuffle *job = (StripeShuffle *)arg;
 
-    if (fflush(destination) != 0)
+    if (job->num_threads_io > 0)
     {
-        perror("Failed to flush buffer");
-        fclose(destination);
-        return EXIT_FAILURE;
+        omp_set_num_threads(job->num_threads_io);
     }
 
-    if (fsync(fileno(destination)) != 0)
+    char *src_name = job->temp_name;
+    unsigned long long num_slices = rounds;
+    unsigned long long slice_records = num_records_in_bucket;
+    job->elapsed_time = 0.0;
+    for (int pass = 0; pass < job->plan->num_passes; pass++)
     {
-        perror("Failed to fsync buffer");
-        fclose(destination);
-        return EXIT_FAILURE;
+        char *dest_name = job->final_name;
+        if (pass + 1 < job->plan->num_passes)
+        {
+            char suffix[32];
+            snprintf(suffix, sizeof(suffix), ".pass%d", pass + 1);
+            dest_name = concat_strings(job->temp_name, suffix);
+            if (dest_name == NULL)
+            {
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        job->elapsed_time += shuffle_pass(src_name, dest_name, num_slices, job->plan->factors[pass], slice_records, job->memory_bytes,
+                                          job->num_threads_io, job->start_time, pass, job->plan->num_passes, job->stripe_buckets, job->stripe);
+
+        remove_file(src_name);
+        if (src_name != job->temp_name)
+        {
+            free(src_name);
+        }
+        src_name = dest_name;
+        num_slices /= job->plan->factors[pass];
+        slice_records *= job->plan->factors[pass];
     }
+    return NULL;
+}
 
-    fclose(destination);
+// Function to write a plot held in memory to its file in one pass
+void write_plot_file(const char *filename, const void *records, unsigned long long size)
+{
+    int fd_dest = open_temp_file(filename, DIRECT_IO);
+    if (fd_dest < 0)
+    {
+        printf("Error opening file %s (#5)\n", filename);
+        perror("Error opening file");
+        exit(EXIT_FAILURE);
+    }
+    preallocate_file(fd_dest, size, filename);
+    advise_file(fd_dest, 0, 0, POSIX_FADV_SEQUENTIAL);
 
-    if (remove(source_path) != 0)
+    IoQueue plot_io;
+    if (!io_queue_init(&plot_io, IO_BACKEND, QUEUE_DEPTH))
     {
-        perror("Error deleting source file after moving");
-        return -1;
+        fprintf(stderr, "Error: Unable to allocate memory for the I/O queue.\n");
+        exit(EXIT_FAILURE);
     }
 
-    if (!BENCHMARK)
-        printf("deep copy finished!\n");
-    if (DEBUG)
-        printf("move_file_overwrite() finished!\n");
-    return 0; // Success
+    // Written in pieces so the governor can keep the dirty pages bounded
+    WritebackGovernor plot_writeback;
+    writeback_init(&plot_writeback, fd_dest);
+    for (unsigned long long offset = 0; offset < size; offset += WRITEBACK_CHUNK_SIZE)
+    {
+        size_t chunk = size - offset < WRITEBACK_CHUNK_SIZE ? size - offset : WRITEBACK_CHUNK_SIZE;
+        io_queue_write(&plot_io, fd_dest, (const uint8_t *)records + offset, chunk, offset, 0);
+        io_queue_drain(&plot_io);
+        writeback_range(&plot_writeback, offset, chunk);
+    }
+    io_queue_free(&plot_io);
+    writeback_finish(&plot_writeback);
+    close(fd_dest);
 }
 
 int main(int argc, char *argv[])
@@ -1026,6 +4232,24 @@ int main(int argc, char *argv[])
         {"prefix_search_size", required_argument, 0, 'p'},
         {"benchmark", required_argument, 0, 'x'},
         {"debug", required_argument, 0, 'd'},
+        {"pipeline", required_argument, 0, 'P'},
+        {"direct_io", required_argument, 0, 'D'},
+        {"io_backend", required_argument, 0, 'I'},
+        {"queue_depth", required_argument, 0, 'Q'},
+        {"lookup_depth", required_argument, 0, 'l'},
+        {"lookup_mode", required_argument, 0, 'o'},
+        {"direct_final", required_argument, 0, 'F'},
+        {"in_memory", required_argument, 0, 'M'},
+        {"shuffle_in_place", required_argument, 0, 'S'},
+        {"shuffle_passes", required_argument, 0, 'L'},
+        {"min_read", required_argument, 0, 'R'},
+        {"seek_time", required_argument, 0, 'E'},
+        {"disk_bandwidth", required_argument, 0, 'B'},
+        {"preallocate", required_argument, 0, 'A'},
+        {"writeback_limit", required_argument, 0, 'W'},
+        {"stripe_dirs", required_argument, 0, 'X'},
+        {"transpose_bench", required_argument, 0, 'T'},
+        {"hash_sort", required_argument, 0, 'H'},
         {"help", no_argument, 0, 'h'},
         {0, 0, 0, 0}};
 
@@ -1035,7 +4259,7 @@ int main(int argc, char *argv[])
     int option_index = 0;
 
     // Parse command-line arguments
-    while ((opt = getopt_long(argc, argv, "a:t:i:K:m:f:g:b:w:c:v:s:p:x:d:h", long_options, &option_index)) != -1)
+    while ((opt = getopt_long(argc, argv, "a:t:i:K:m:f:g:b:w:c:v:s:p:x:d:P:D:I:Q:l:o:F:M:S:L:R:E:B:A:W:X:T:H:h", long_options, &option_index)) != -1)
     {
         switch (opt)
         {
@@ -1140,36 +4364,223 @@ int main(int argc, char *argv[])
             SEARCH = true;
             HASHGEN = false;
             break;
-        case 'p':
-            SEARCH_BATCH = true;
-            SEARCH = true;
-            HASHGEN = false;
-            PREFIX_SEARCH_SIZE = atoi(optarg);
-            if (PREFIX_SEARCH_SIZE < 1)
+        case 'p':
+            SEARCH_BATCH = true;
+            SEARCH = true;
+            HASHGEN = false;
+            PREFIX_SEARCH_SIZE = atoi(optarg);
+            if (PREFIX_SEARCH_SIZE < 1)
+            {
+                fprintf(stderr, "PREFIX_SEARCH_SIZE must be 1 or greater.\n");
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'x':
+            if (strcmp(optarg, "true") == 0)
+            {
+                BENCHMARK = true;
+            }
+            else
+            {
+                BENCHMARK = false;
+            }
+            break;
+        case 'd':
+            if (strcmp(optarg, "true") == 0)
+            {
+                DEBUG = true;
+            }
+            else
+            {
+                DEBUG = false;
+            }
+            break;
+        case 'P':
+            if (strcmp(optarg, "true") == 0)
+            {
+                PIPELINE = true;
+            }
+            else
+            {
+                PIPELINE = false;
+            }
+            break;
+        case 'D':
+            if (strcmp(optarg, "true") == 0)
+            {
+                DIRECT_IO = true;
+            }
+            else
+            {
+                DIRECT_IO = false;
+            }
+            break;
+        case 'I':
+            if (!parse_io_backend(optarg, &IO_BACKEND))
+            {
+                fprintf(stderr, "Invalid I/O backend: %s\n", optarg);
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'Q':
+            if (atoi(optarg) < 1)
+            {
+                fprintf(stderr, "Queue depth must be 1 or greater.\n");
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            QUEUE_DEPTH = atoi(optarg);
+            break;
+        case 'l':
+            if (atoi(optarg) < 0)
+            {
+                fprintf(stderr, "Lookup queue depth must be 0 or greater.\n");
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            LOOKUP_DEPTH = atoi(optarg);
+            break;
+        case 'o':
+            if (!parse_lookup_mode(optarg, &LOOKUP_MODE))
+            {
+                fprintf(stderr, "Invalid lookup mode: %s\n", optarg);
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'F':
+            if (atoi(optarg) < 0)
+            {
+                fprintf(stderr, "Direct final write size must be 0 or greater.\n");
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            DIRECT_FINAL_KB = atoi(optarg);
+            break;
+        case 'M':
+            if (strcmp(optarg, "auto") == 0)
+            {
+                IN_MEMORY_AUTO = true;
+            }
+            else if (strcmp(optarg, "true") == 0)
+            {
+                IN_MEMORY_AUTO = false;
+                IN_MEMORY = true;
+            }
+            else
+            {
+                IN_MEMORY_AUTO = false;
+                IN_MEMORY = false;
+            }
+            break;
+        case 'S':
+            if (strcmp(optarg, "true") == 0)
+            {
+                SHUFFLE_IN_PLACE = true;
+            }
+            else
+            {
+                SHUFFLE_IN_PLACE = false;
+            }
+            break;
+        case 'L':
+            if (atoi(optarg) < 0 || atoi(optarg) > SHUFFLE_MAX_PASSES)
+            {
+                fprintf(stderr, "Shuffle passes must be between 0 and %d.\n", SHUFFLE_MAX_PASSES);
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            SHUFFLE_PASSES = atoi(optarg);
+            break;
+        case 'R':
+            if (atoi(optarg) < 0)
+            {
+                fprintf(stderr, "Minimum read size must be 0 or greater.\n");
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            SHUFFLE_MIN_READ_KB = atoi(optarg);
+            break;
+        case 'E':
+            SEEK_TIME_MS = atof(optarg);
+            if (SEEK_TIME_MS < 0)
+            {
+                fprintf(stderr, "Seek time must be 0 or greater.\n");
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'B':
+            DISK_BANDWIDTH_MBPS = atof(optarg);
+            if (DISK_BANDWIDTH_MBPS <= 0)
+            {
+                fprintf(stderr, "Disk bandwidth must be greater than 0.\n");
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'A':
+            if (strcmp(optarg, "contiguous") == 0)
+            {
+                PREALLOCATE = PREALLOCATE_CONTIGUOUS;
+            }
+            else if (strcmp(optarg, "true") == 0)
+            {
+                PREALLOCATE = PREALLOCATE_ON;
+            }
+            else
+            {
+                PREALLOCATE = PREALLOCATE_OFF;
+            }
+            break;
+        case 'X':
+            NUM_STRIPES = 0;
+            for (char *dir = strtok(optarg, ","); dir != NULL; dir = strtok(NULL, ","))
+            {
+                if (NUM_STRIPES == MAX_STRIPES)
+                {
+                    fprintf(stderr, "At most %d stripe directories are supported.\n", MAX_STRIPES);
+                    exit(EXIT_FAILURE);
+                }
+                STRIPE_DIRS[NUM_STRIPES++] = dir;
+            }
+            // Stripes hold equal power of two bucket ranges, like the shuffle's groups
+            if (NUM_STRIPES == 0 || (NUM_STRIPES & (NUM_STRIPES - 1)) != 0)
+            {
+                fprintf(stderr, "The number of stripe directories must be a power of 2.\n");
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'W':
+            if (atoi(optarg) < 0)
             {
-                fprintf(stderr, "PREFIX_SEARCH_SIZE must be 1 or greater.\n");
+                fprintf(stderr, "Writeback limit must be 0 or greater.\n");
                 print_usage(argv[0]);
                 exit(EXIT_FAILURE);
             }
+            WRITEBACK_LIMIT_MB = atoi(optarg);
             break;
-        case 'x':
+        case 'T':
             if (strcmp(optarg, "true") == 0)
             {
-                BENCHMARK = true;
+                TRANSPOSE_BENCH = true;
             }
             else
             {
-                BENCHMARK = false;
+                TRANSPOSE_BENCH = false;
             }
             break;
-        case 'd':
+        case 'H':
             if (strcmp(optarg, "true") == 0)
             {
-                DEBUG = true;
+                HASH_SORT = true;
             }
             else
             {
-                DEBUG = false;
+                HASH_SORT = false;
             }
             break;
         case 'h':
@@ -1213,6 +4624,12 @@ int main(int argc, char *argv[])
     // printf("Memory Size (MB)            : %llu\n", MEMORY_SIZE_MB);
     // printf("Memory Size (bytes)            : %llu\n", MEMORY_SIZE_bytes);
 
+    // Pipelined hashgen keeps two bucket tables in memory, so each gets half of the budget
+    if (HASHGEN && PIPELINE && (writeData || writeDataFinal) && MEMORY_SIZE_bytes < file_size_bytes)
+    {
+        MEMORY_SIZE_bytes /= 2;
+    }
+
     rounds = ceil(file_size_bytes / MEMORY_SIZE_bytes);
     MEMORY_SIZE_bytes = file_size_bytes / rounds;
     num_hashes = floor(MEMORY_SIZE_bytes / NONCE_SIZE);
@@ -1228,6 +4645,18 @@ int main(int argc, char *argv[])
 
     num_records_in_bucket = num_hashes / num_buckets;
 
+    if (HASHGEN && num_records_in_bucket == 0)
+    {
+        fprintf(stderr, "Error: %llu buckets do not fit in %llu bytes per round, use more memory.\n", num_buckets, MEMORY_SIZE_bytes);
+        exit(EXIT_FAILURE);
+    }
+
+    if (HASHGEN && num_records_in_bucket > BUCKET_COUNT_MAX)
+    {
+        fprintf(stderr, "Error: %llu records per bucket exceed the bucket count limit of %d, use less memory.\n", num_records_in_bucket, BUCKET_COUNT_MAX);
+        exit(EXIT_FAILURE);
+    }
+
     MEMORY_SIZE_bytes = num_buckets * num_records_in_bucket * sizeof(MemoRecord);
     MEMORY_SIZE_MB = (unsigned long long)(MEMORY_SIZE_bytes / (1024 * 1024));
     file_size_bytes = MEMORY_SIZE_bytes * rounds;
@@ -1235,6 +4664,96 @@ int main(int argc, char *argv[])
     num_hashes = floor(MEMORY_SIZE_bytes / NONCE_SIZE);
     num_iterations = num_hashes * rounds;
 
+    // In-memory mode (opt-in, it keeps more than the -m budget resident): every
+    // round hashes into its slice of each bucket of one resident table, which then
+    // already is the final file; the temporary file and the shuffle's second pass
+    // are skipped. -M auto only does so if the whole plot fits in free memory, and
+    // an explicit direct final layout (-F) takes precedence over the automatic choice
+    bool in_memory = false;
+    if (HASHGEN && writeDataFinal && rounds > 1)
+    {
+        if (IN_MEMORY_AUTO)
+        {
+            unsigned long long in_memory_bytes = file_size_bytes + num_buckets * sizeof(bucket_count_t) + omp_get_max_threads() * sizeof(StagingBuffer);
+            in_memory = DIRECT_FINAL_KB == 0 && in_memory_bytes <= get_available_memory_bytes();
+        }
+        else
+        {
+            in_memory = IN_MEMORY;
+        }
+
+        if (in_memory)
+        {
+            writeData = false;
+        }
+    }
+
+    // Direct-to-final mode: each round is written straight into its slice of every
+    // group of buckets in the final file, so neither the temporary file nor the
+    // shuffle is needed; groups are sized so every such write is large enough
+    bool direct_final = false;
+    PlotLayout final_layout;
+    if (HASHGEN && DIRECT_FINAL_KB > 0 && writeDataFinal && rounds > 1 && !in_memory && NUM_STRIPES > 1)
+    {
+        if (!BENCHMARK)
+            printf("Direct final writes are not supported for a striped plot, using the temporary files and shuffle\n");
+    }
+    else if (HASHGEN && DIRECT_FINAL_KB > 0 && writeDataFinal && rounds > 1 && !in_memory)
+    {
+        unsigned long long slice_bytes = num_records_in_bucket * sizeof(MemoRecord);
+        // O_DIRECT needs every write to start on a 4 KB boundary
+        unsigned long long min_group_buckets = DIRECT_IO ? 4096 : 1;
+        unsigned long long group_buckets = 1;
+        while (group_buckets < num_buckets && (group_buckets * slice_bytes < DIRECT_FINAL_KB * 1024 || group_buckets < min_group_buckets))
+        {
+            group_buckets *= 2;
+        }
+
+        if (group_buckets * slice_bytes >= DIRECT_FINAL_KB * 1024)
+        {
+            direct_final = true;
+            final_layout.slices = rounds;
+            final_layout.records_in_slice = num_records_in_bucket;
+            final_layout.group_buckets = group_buckets;
+            final_layout.flags = 0;
+
+            // Rounds are written to the final file in place of the temporary file
+            FILENAME = FILENAME_FINAL;
+            writeData = true;
+        }
+        else if (!BENCHMARK)
+        {
+            printf("Direct final writes of %llu KB do not fit in a round, using the temporary file and shuffle\n", DIRECT_FINAL_KB);
+        }
+    }
+
+    // Shuffle mode: rounds go to the temporary file and one or more passes merge
+    // them into the final file; the planner trades extra passes against seeks
+    bool shuffle = HASHGEN && writeDataFinal && rounds > 1 && !in_memory && !direct_final;
+    ShufflePlan shuffle_plan;
+    if (shuffle)
+    {
+        // Stripes are shuffled side by side, each with its share of the memory
+        plan_shuffle(&shuffle_plan, file_size_bytes / NUM_STRIPES, MEMORY_SIZE_bytes / NUM_STRIPES);
+    }
+
+    // A striped plot keeps buckets [k * stripe_buckets, (k + 1) * stripe_buckets) in
+    // a temporary and a final file of its own in directory k; the final file name
+    // then holds the manifest that lists the stripes
+    unsigned long long stripe_buckets = num_buckets / NUM_STRIPES;
+    unsigned long long stripe_bytes = file_size_bytes / NUM_STRIPES;
+    char *temp_names[MAX_STRIPES];
+    char *final_names[MAX_STRIPES];
+    for (int k = 0; k < NUM_STRIPES; k++)
+    {
+        temp_names[k] = FILENAME;
+        final_names[k] = FILENAME_FINAL;
+        if (NUM_STRIPES > 1 && FILENAME != NULL)
+            temp_names[k] = stripe_path(STRIPE_DIRS[k], FILENAME, k);
+        if (NUM_STRIPES > 1 && FILENAME_FINAL != NULL)
+            final_names[k] = stripe_path(STRIPE_DIRS[k], FILENAME_FINAL, k);
+    }
+
     if (!BENCHMARK)
     {
         if (SEARCH)
@@ -1277,57 +4796,152 @@ int main(int argc, char *argv[])
             else
                 printf("CIRCULAR_ARRAY              : false\n");
 
-            if (writeData)
+            if (PIPELINE)
+                printf("PIPELINE                    : true\n");
+            else
+                printf("PIPELINE                    : false\n");
+
+            if (DIRECT_IO)
+                printf("DIRECT_IO                   : true\n");
+            else
+                printf("DIRECT_IO                   : false\n");
+
+            if (SHUFFLE_IN_PLACE)
+                printf("SHUFFLE_IN_PLACE            : true\n");
+            else
+                printf("SHUFFLE_IN_PLACE            : false\n");
+
+            printf("I/O Backend                 : %s (queue depth %u)\n", io_backend_name(IO_BACKEND), QUEUE_DEPTH);
+            printf("Writeback Limit             : %llu MB\n", WRITEBACK_LIMIT_MB);
+            printf("Hash Sorted Buckets         : %s\n", HASH_SORT ? "true" : "false");
+            printf("Preallocate                 : %s\n", PREALLOCATE == PREALLOCATE_OFF ? "false" : PREALLOCATE == PREALLOCATE_ON ? "true" : "contiguous");
+
+            if (direct_final)
+            {
+                printf("Direct Final Layout         : %llu buckets per group, %llu KB per write\n", final_layout.group_buckets, final_layout.group_buckets * num_records_in_bucket * sizeof(MemoRecord) / 1024);
+            }
+            else if (in_memory)
+            {
+                printf("In-Memory Plot              : %llu MB resident, no temporary file, overrides -m\n", file_size_bytes / (1024 * 1024));
+            }
+            else if (writeData)
             {
                 printf("Temporary File              : %s\n", FILENAME);
             }
+            if (shuffle)
+            {
+                printf("Shuffle Passes              : %d (", shuffle_plan.num_passes);
+                for (int pass = 0; pass < shuffle_plan.num_passes; pass++)
+                {
+                    printf("%s%llu", pass > 0 ? " x " : "", shuffle_plan.factors[pass]);
+                }
+                printf(" slices per merge), reads >= %llu KB, predicted %.0f s (%.0f s in one pass)\n",
+                       shuffle_plan.min_read_bytes / 1024, shuffle_plan.predicted_seconds, shuffle_plan.single_pass_seconds);
+            }
             if (writeDataFinal)
             {
                 printf("Output File Final           : %s\n", FILENAME_FINAL);
             }
+            if (NUM_STRIPES > 1)
+            {
+                printf("Stripes                     : %d x %llu buckets (", NUM_STRIPES, stripe_buckets);
+                for (int k = 0; k < NUM_STRIPES; k++)
+                {
+                    printf("%s%s", k > 0 ? ", " : "", STRIPE_DIRS[k]);
+                }
+                printf(")\n");
+            }
         }
     }
 
+    if (TRANSPOSE_BENCH)
+    {
+        run_transpose_benchmark(shuffle_group_buckets(MEMORY_SIZE_bytes / NUM_STRIPES, rounds * num_records_in_bucket, num_buckets / NUM_STRIPES));
+        return EXIT_SUCCESS;
+    }
+
     if (HASHGEN)
     {
         printf("HASHGEN                      : true\n");
 
-        // Open the file for writing in binary mode
-        FILE *fd = NULL;
-        if (writeData)
+        // Open the file, or each stripe's file, for writing with explicit-offset writes;
+        // round writes go through their own queue per file, used by one thread at a time
+        int fds[MAX_STRIPES];
+        IoQueue round_io[MAX_STRIPES];
+        WritebackGovernor round_writeback[MAX_STRIPES];
+        RoundWrite jobs[MAX_STRIPES];
+        for (int k = 0; writeData && k < NUM_STRIPES; k++)
         {
-            fd = fopen(FILENAME, "wb+");
-            if (fd == NULL)
+            fds[k] = open_temp_file(temp_names[k], DIRECT_IO);
+            if (fds[k] < 0)
             {
-                printf("Error opening file %s (#4)\n", FILENAME);
+                printf("Error opening file %s (#4)\n", temp_names[k]);
 
                 perror("Error opening file");
                 return EXIT_FAILURE;
             }
+            preallocate_file(fds[k], stripe_bytes, temp_names[k]);
+            advise_file(fds[k], 0, 0, POSIX_FADV_SEQUENTIAL);
+
+            if (!io_queue_init(&round_io[k], IO_BACKEND, QUEUE_DEPTH))
+            {
+                fprintf(stderr, "Error: Unable to allocate memory for the I/O queue.\n");
+                exit(EXIT_FAILURE);
+            }
+            writeback_init(&round_writeback[k], fds[k]);
+
+            jobs[k].io = &round_io[k];
+            jobs[k].writeback = &round_writeback[k];
+            jobs[k].layout = direct_final ? &final_layout : NULL;
+            jobs[k].fd = fds[k];
+            jobs[k].first_bucket = k * stripe_buckets;
+            jobs[k].stripe_buckets = stripe_buckets;
         }
 
         // Start walltime measurement
         double start_time = omp_get_wtime();
 
-        // Allocate memory for the array of Buckets
-        Bucket *buckets = (Bucket *)calloc(num_buckets, sizeof(Bucket));
-        if (buckets == NULL)
-        {
-            fprintf(stderr, "Error: Unable to allocate memory for buckets.\n");
-            exit(EXIT_FAILURE);
-        }
+        // Double-buffer the bucket tables only if there is a next round to overlap with
+        bool pipelined = PIPELINE && writeData && rounds > 1;
+        int num_tables = pipelined ? 2 : 1;
 
-        // Allocate memory for each bucket's records
-        for (unsigned long long i = 0; i < num_buckets; i++)
+        // Allocate one arena for all buckets' records of each table; in memory,
+        // a single table has room for every round's slice of each bucket
+        BucketTable tables[2];
+        size_t bucket_stride = in_memory ? rounds * num_records_in_bucket : num_records_in_bucket;
+        for (int t = 0; t < num_tables; t++)
         {
-            buckets[i].records = (MemoRecord *)calloc(num_records_in_bucket, sizeof(MemoRecord));
-            if (buckets[i].records == NULL)
+            if (!allocate_bucket_table(&tables[t], bucket_stride))
             {
-                fprintf(stderr, "Error: Unable to allocate memory for records.\n");
+                fprintf(stderr, "Error: Unable to allocate memory for buckets.\n");
                 exit(EXIT_FAILURE);
             }
         }
 
+        // One staging buffer per thread that may run hashgen_batch
+        int num_staging = omp_get_max_threads();
+#ifdef __cplusplus
+        if (tbb::this_task_arena::max_concurrency() > num_staging)
+        {
+            num_staging = tbb::this_task_arena::max_concurrency();
+        }
+#endif
+        StagingBuffer **staging = allocate_staging(num_staging);
+        if (staging == NULL)
+        {
+            fprintf(stderr, "Error: Unable to allocate memory for staging buffers.\n");
+            exit(EXIT_FAILURE);
+        }
+
+        if (!BENCHMARK)
+        {
+            printf("Bucket Tables               : %d\n", num_tables);
+            printf("Bucket Arena (MB)           : %zu (%s)\n", tables[0].arena_size / (1024 * 1024), tables[0].huge_pages ? "MAP_HUGETLB" : "transparent huge pages");
+            printf("Bucket Metadata (MB)        : %llu\n", num_buckets * sizeof(bucket_count_t) / (1024 * 1024));
+            if (DEBUG)
+                printf("arena allocated in %.6f seconds\n", omp_get_wtime() - start_time);
+        }
+
         double throughput_hash = 0.0;
         double throughput_io = 0.0;
 
@@ -1343,17 +4957,26 @@ int main(int argc, char *argv[])
         double elapsed_time_io_total = 0.0;
         double elapsed_time_io2_total = 0.0;
 
+        // Pipelined mode: the writer threads drain round r-1's table while round r hashes;
+        // a striped plot has one writer thread per stripe
+        pthread_t writers[MAX_STRIPES];
+        bool writer_active = false;
+        double elapsed_time_write_total = 0.0;
+        double elapsed_time_overlap_total = 0.0;
+
         for (unsigned long long r = 0; r < rounds; r++)
         {
             start_time_hash = omp_get_wtime();
 
-            // Reset bucket counts
-            for (unsigned long long i = 0; i < num_buckets; i++)
+            BucketTable *table = &tables[r % num_tables];
+            if (in_memory)
             {
-                buckets[i].count = 0;
-                buckets[i].flush = 0;
+                table->slice_offset = r * num_records_in_bucket;
             }
 
+            // Reset bucket counts
+            memset(table->counts, 0, num_buckets * sizeof(bucket_count_t));
+
             unsigned long long start_idx = r * num_hashes;
             unsigned long long end_idx = start_idx + num_hashes;
 
@@ -1369,24 +4992,13 @@ int main(int argc, char *argv[])
                         {
 #pragma omp task
                             {
-                                MemoRecord record;
-                                uint8_t record_hash[HASH_SIZE];
-
                                 unsigned long long batch_end = i + BATCH_SIZE;
                                 if (batch_end > end_idx)
                                 {
                                     batch_end = end_idx;
                                 }
 
-                                for (unsigned long long j = i; j < batch_end; j++)
-                                {
-                                    generateBlake3(record_hash, &record, j);
-                                    if (MEMORY_WRITE)
-                                    {
-                                        off_t bucketIndex = getBucketIndex(record_hash, PREFIX_SIZE);
-                                        insert_record(buckets, &record, bucketIndex);
-                                    }
-                                }
+                                hashgen_batch(table, staging[omp_get_thread_num()], i, batch_end);
                             }
                         }
                     }
@@ -1398,24 +5010,13 @@ int main(int argc, char *argv[])
 #pragma omp parallel for schedule(static)
                 for (unsigned long long i = start_idx; i < end_idx; i += BATCH_SIZE)
                 {
-                    MemoRecord record;
-                    uint8_t record_hash[HASH_SIZE];
-
                     unsigned long long batch_end = i + BATCH_SIZE;
                     if (batch_end > end_idx)
                     {
                         batch_end = end_idx;
                     }
 
-                    for (unsigned long long j = i; j < batch_end; j++)
-                    {
-                        generateBlake3(record_hash, &record, j);
-                        if (MEMORY_WRITE)
-                        {
-                            off_t bucketIndex = getBucketIndex(record_hash, PREFIX_SIZE);
-                            insert_record(buckets, &record, bucketIndex);
-                        }
-                    }
+                    hashgen_batch(table, staging[omp_get_thread_num()], i, batch_end);
                 }
             }
 #ifndef __cplusplus
@@ -1441,54 +5042,70 @@ int main(int argc, char *argv[])
                         for (unsigned long long i = batch_range.begin(); i < batch_range.end(); i += BATCH_SIZE)
                         {
                             unsigned long long batch_end = i + BATCH_SIZE;
-                            if (batch_end > end_idx)
+                            if (batch_end > batch_range.end())
                             {
-                                batch_end = end_idx;
+                                batch_end = batch_range.end();
                             }
 
-                            for (unsigned long long j = i; j < batch_end; ++j)
-                            {
-                                MemoRecord record;
-                                uint8_t record_hash[HASH_SIZE];
-
-                                generateBlake3(record_hash, &record, j);
-
-                                if (MEMORY_WRITE)
-                                {
-                                    off_t bucketIndex = getBucketIndex(record_hash, PREFIX_SIZE);
-                                    insert_record(buckets, &record, bucketIndex);
-                                }
-                            }
+                            hashgen_batch(table, staging[tbb::this_task_arena::current_thread_index()], i, batch_end);
                         }
                     });
             }
 #endif
             // after else if
+
+            // Second phase: drain the runs still staged by every thread
+            if (MEMORY_WRITE)
+            {
+                flush_staging(table, staging, num_staging);
+                clear_unfilled_slots(table);
+            }
+
             // End hash computation time measurement
             end_time_hash = omp_get_wtime();
             elapsed_time_hash = end_time_hash - start_time_hash;
             elapsed_time_hash_total += elapsed_time_hash;
 
             // Write data to disk if required
-            if (writeData)
+            if (pipelined)
             {
+                // Only the time spent waiting on the writer counts as I/O time here
                 start_time_io = omp_get_wtime();
-
-                // Seek to the correct position in the file
-                off_t offset = r * num_records_in_bucket * num_buckets * NONCE_SIZE;
-                if (fseeko(fd, offset, SEEK_SET) < 0)
+                if (writer_active)
                 {
-                    perror("Error seeking in file");
-                    fclose(fd);
-                    exit(EXIT_FAILURE);
+                    double start_time_write, end_time_write;
+                    join_round_writers(jobs, writers, NUM_STRIPES, &start_time_write, &end_time_write);
+                    elapsed_time_write_total += end_time_write - start_time_write;
+                    // Part of the previous round's write that ran while this round hashed
+                    double overlap = fmin(end_time_write, end_time_hash) - fmax(start_time_write, start_time_hash);
+                    if (overlap > 0)
+                    {
+                        elapsed_time_overlap_total += overlap;
+                    }
                 }
+                end_time_io = omp_get_wtime();
+                elapsed_time_io = end_time_io - start_time_io;
+                elapsed_time_io_total += elapsed_time_io;
 
-                size_t bytesWritten = 0;
-                // Write buckets to disk
-                for (unsigned long long i = 0; i < num_buckets; i++)
-                {
-                    bytesWritten += writeBucketToDiskSequential(&buckets[i], fd);
-                }
+                start_round_writers(jobs, writers, NUM_STRIPES, table, r);
+                writer_active = true;
+            }
+            else if (writeData && NUM_STRIPES > 1)
+            {
+                // The stripes' drives are written in parallel
+                start_time_io = omp_get_wtime();
+                double start_time_write, end_time_write;
+                start_round_writers(jobs, writers, NUM_STRIPES, table, r);
+                join_round_writers(jobs, writers, NUM_STRIPES, &start_time_write, &end_time_write);
+                end_time_io = omp_get_wtime();
+                elapsed_time_io = end_time_io - start_time_io;
+                elapsed_time_io_total += elapsed_time_io;
+            }
+            else if (writeData)
+            {
+                start_time_io = omp_get_wtime();
+
+                write_round(table, &round_io[0], &round_writeback[0], fds[0], r, direct_final ? &final_layout : NULL, 0, num_buckets);
                 // End I/O time measurement
                 end_time_io = omp_get_wtime();
                 elapsed_time_io = end_time_io - start_time_io;
@@ -1509,18 +5126,38 @@ int main(int argc, char *argv[])
             //}
         }
 
+        // Drain the last round's table, nothing is left to overlap it with
+        if (writer_active)
+        {
+            start_time_io = omp_get_wtime();
+            double start_time_write, end_time_write;
+            join_round_writers(jobs, writers, NUM_STRIPES, &start_time_write, &end_time_write);
+            elapsed_time_write_total += end_time_write - start_time_write;
+            end_time_io = omp_get_wtime();
+            elapsed_time_io_total += end_time_io - start_time_io;
+        }
+
+        if (pipelined && !BENCHMARK)
+        {
+            printf("Pipeline Overlap: %.2f seconds of %.2f seconds hashing and %.2f seconds writing (%.2f%% of writes hidden)\n",
+                   elapsed_time_overlap_total, elapsed_time_hash_total, elapsed_time_write_total,
+                   elapsed_time_write_total > 0 ? elapsed_time_overlap_total * 100.0 / elapsed_time_write_total : 0.0);
+        }
+
         start_time_io = omp_get_wtime();
 
-        // Flush and close the file
-        if (writeData)
+        // Close the file; the shuffle reopens it for reading
+        for (int k = 0; writeData && k < NUM_STRIPES; k++)
         {
-            if (fflush(fd) != 0)
+            io_queue_free(&round_io[k]);
+            writeback_finish(&round_writeback[k]);
+            if (DEBUG)
+                printf("Round Writeback Wait: %.2f seconds\n", round_writeback[k].wait_time);
+            if (close(fds[k]) != 0)
             {
-                perror("Failed to flush buffer");
-                fclose(fd);
+                perror("Failed to close file");
                 return EXIT_FAILURE;
             }
-            // fclose(fd);
         }
 
         end_time_io = omp_get_wtime();
@@ -1534,271 +5171,197 @@ int main(int argc, char *argv[])
         if (VERIFY) {
             unsigned long long num_zero = 0;
             for (unsigned long long i = 0; i < num_buckets; i++) {
-                for (unsigned long long j = 0; j < buckets[i].count; j++) {
-                    if (byteArrayToLongLong(buckets[i].records[j].nonce, NONCE_SIZE) == 0)
+                for (unsigned long long j = 0; j < tables[0].counts[i]; j++) {
+                    if (byteArrayToLongLong(bucket_records(&tables[0], i)[j].nonce, NONCE_SIZE) == 0)
                         num_zero++;
                 }
             }
             printf("Number of zero nonces: %llu\n", num_zero);
         }*/
 
-        // Free allocated memory
-        for (unsigned long long i = 0; i < num_buckets; i++)
-        {
-            free(buckets[i].records);
-        }
-        free(buckets);
-
-        if (writeDataFinal && rounds > 1)
+        // The resident table holds the final layout, write it out in one pass
+        if (in_memory)
         {
-            // Open the file for writing in binary mode
-            FILE *fd_dest = NULL;
-            if (writeDataFinal)
+            // The table is bucket-major, the sort costs no extra pass over the plot
+            if (HASH_SORT && writeDataFinal)
             {
-                fd_dest = fopen(FILENAME_FINAL, "wb+");
-                if (fd_dest == NULL)
-                {
-                    printf("Error opening file %s (#5)\n", FILENAME_FINAL);
-                    perror("Error opening file");
-
-                    // perror("Error opening file");
-                    return EXIT_FAILURE;
-                }
+                hash_sort_buckets(tables[0].records, num_buckets, tables[0].bucket_stride);
             }
 
-            unsigned long long num_buckets_to_read = ceil((MEMORY_SIZE_bytes / (num_records_in_bucket * rounds * NONCE_SIZE)) / 2);
-            if (DEBUG)
-                printf("will read %llu buckets at one time, %llu bytes\n", num_buckets_to_read, num_records_in_bucket * rounds * NONCE_SIZE * num_buckets_to_read);
-            // need to fix this for 5 byte NONCE_SIZE
-            if (num_buckets % num_buckets_to_read != 0)
+            double start_time_write = omp_get_wtime();
+
+            // Each stripe is a consecutive range of the table's buckets, written by a thread of its own
+#pragma omp parallel for num_threads(NUM_STRIPES) schedule(static, 1)
+            for (int k = 0; k < NUM_STRIPES; k++)
             {
-                uint64_t ratio = num_buckets / num_buckets_to_read;
-                uint64_t result = largest_power_of_two_less_than(ratio);
-                if (DEBUG)
-                    printf("Largest power of 2 less than %lu is %lu\n", ratio, result);
-                num_buckets_to_read = num_buckets / result;
-                if (DEBUG)
-                    printf("will read %llu buckets at one time, %llu bytes\n", num_buckets_to_read, num_records_in_bucket * rounds * NONCE_SIZE * num_buckets_to_read);
-                // printf("error, num_buckets_to_read is not a multiple of num_buckets, exiting: num_buckets=%llu num_buckets_to_read=%llu...\n",num_buckets,num_buckets_to_read);
-                // return EXIT_FAILURE;
+                write_plot_file(final_names[k], (const uint8_t *)tables[0].records + k * stripe_bytes, stripe_bytes);
             }
 
-            // Calculate the total number of records to read per batch
-            size_t records_per_batch = num_records_in_bucket * num_buckets_to_read;
-            // Calculate the size of the buffer needed
-            size_t buffer_size = records_per_batch * rounds;
-            // Allocate the buffer
-            if (DEBUG)
-                printf("allocating %lu bytes for buffer\n", buffer_size * sizeof(MemoRecord));
-            MemoRecord *buffer = (MemoRecord *)malloc(buffer_size * sizeof(MemoRecord));
-            if (buffer == NULL)
+            elapsed_time_io2 = omp_get_wtime() - start_time_write;
+            elapsed_time_io2_total += elapsed_time_io2;
+            if (!BENCHMARK)
+                printf("[%.2f] Plot Write: %.2f MB/s\n", omp_get_wtime() - start_time, file_size_bytes / (elapsed_time_io2 * 1024 * 1024));
+        }
+
+        // Free allocated memory
+        for (int t = 0; t < num_tables; t++)
+        {
+            free_bucket_table(&tables[t]);
+        }
+        free_staging(staging, num_staging);
+
+        if (direct_final)
+        {
+            // A group of one bucket is the classic layout, anything else needs the footer
+            if (final_layout.group_buckets > 1 && !write_plot_footer(FILENAME_FINAL, &final_layout, num_buckets))
             {
-                fprintf(stderr, "Error allocating memory for buffer.\n");
-                exit(EXIT_FAILURE);
+                printf("Error writing plot footer to %s\n", FILENAME_FINAL);
+                return EXIT_FAILURE;
             }
-
-            if (DEBUG)
-                printf("allocating %lu bytes for bufferShuffled\n", buffer_size * sizeof(MemoRecord));
-            MemoRecord *bufferShuffled = (MemoRecord *)malloc(buffer_size * sizeof(MemoRecord));
-            if (bufferShuffled == NULL)
+        }
+        else if (shuffle)
+        {
+            // Each stripe is shuffled by a thread of its own with its share of the I/O threads
+            int num_threads_stripe = num_threads_io;
+            if (NUM_STRIPES > 1)
             {
-                fprintf(stderr, "Error allocating memory for bufferShuffled.\n");
-                exit(EXIT_FAILURE);
+                num_threads_stripe = (num_threads_io > 0 ? num_threads_io : omp_get_max_threads()) / NUM_STRIPES;
+                num_threads_stripe = num_threads_stripe > 0 ? num_threads_stripe : 1;
             }
 
-            // Set the number of threads if specified
-            if (num_threads_io > 0)
+            StripeShuffle stripe_jobs[MAX_STRIPES];
+            pthread_t shufflers[MAX_STRIPES];
+            for (int k = 0; k < NUM_STRIPES; k++)
             {
-                omp_set_num_threads(num_threads_io);
+                stripe_jobs[k].temp_name = temp_names[k];
+                stripe_jobs[k].final_name = final_names[k];
+                stripe_jobs[k].plan = &shuffle_plan;
+                stripe_jobs[k].stripe_buckets = stripe_buckets;
+                stripe_jobs[k].memory_bytes = MEMORY_SIZE_bytes / NUM_STRIPES;
+                stripe_jobs[k].num_threads_io = num_threads_stripe;
+                stripe_jobs[k].start_time = start_time;
+                stripe_jobs[k].stripe = NUM_STRIPES > 1 ? k : -1;
             }
 
-            for (unsigned long long i = 0; i < num_buckets; i = i + num_buckets_to_read)
+            if (NUM_STRIPES == 1)
             {
-                double start_time_io2 = omp_get_wtime();
-
-#pragma omp parallel for schedule(static)
-                for (unsigned long long r = 0; r < rounds; r++)
+                shuffle_stripe(&stripe_jobs[0]);
+            }
+            else
+            {
+                for (int k = 0; k < NUM_STRIPES; k++)
                 {
-                    // off_t offset_src_old = r * num_records_in_bucket * num_buckets * NONCE_SIZE + i*num_records_in_bucket*NONCE_SIZE;
-                    //  Calculate the source offset
-                    off_t offset_src = ((r * num_buckets + i) * num_records_in_bucket) * sizeof(MemoRecord);
-                    // printf("read data: offset_src_old=%llu offset_src=%llu\n",offset_src_old,offset_src);
-                    // if (DEBUG) printf("read data: offset_src_old=%llu bytes=%llu\n",offset_src_old,num_records_in_bucket*NONCE_SIZE*num_buckets_to_read);
-                    if (DEBUG)
-                        printf("read data: offset_src=%lu bytes=%lu\n",
-                               offset_src, records_per_batch * sizeof(MemoRecord));
-
-                    if (fseeko(fd, offset_src, SEEK_SET) < 0)
-                    {
-                        perror("Error seeking in file");
-                        fclose(fd);
-                        exit(EXIT_FAILURE);
-                    }
-
-                    // size_t recordsRead = fread(buffer+num_records_in_bucket*num_buckets_to_read*sizeof(MemoRecord)*r, sizeof(MemoRecord), num_records_in_bucket*num_buckets_to_read, fd);
-                    //  Correct pointer arithmetic
-
-                    size_t index = r * records_per_batch;
-                    if (DEBUG)
-                        printf("storing read data at index %lu\n", index);
-                    size_t recordsRead = fread(&buffer[index],
-                                               sizeof(MemoRecord),
-                                               records_per_batch,
-                                               fd);
-                    // size_t recordsRead = fread(buffer + r * records_per_batch,
-                    //                        sizeof(MemoRecord),
-                    //                        records_per_batch,
-                    //                        fd);
-                    if (recordsRead != records_per_batch)
-                    {
-                        fprintf(stderr, "Error reading file, records read %zu instead of %zu\n",
-                                recordsRead, records_per_batch);
-                        fclose(fd);
-                        exit(EXIT_FAILURE);
-                    }
-                    else
-                    {
-                        if (DEBUG)
-                            printf("read %zu records from disk...\n", recordsRead);
-                    }
-
-                    off_t offset_dest = i * num_records_in_bucket * NONCE_SIZE * rounds;
-                    if (DEBUG)
-                        printf("write data: offset_dest=%lu bytes=%llu\n", offset_dest, num_records_in_bucket * NONCE_SIZE * rounds * num_buckets_to_read);
-
-                    if (fseeko(fd_dest, offset_dest, SEEK_SET) < 0)
+                    if (pthread_create(&shufflers[k], NULL, shuffle_stripe, &stripe_jobs[k]) != 0)
                     {
-                        perror("Error seeking in file");
-                        fclose(fd_dest);
+                        perror("Error creating shuffle thread");
                         exit(EXIT_FAILURE);
                     }
-                    // needs to make sure its ok, fix things....
-                    // printf("buffer_size=%llu my_buffer_size=%llu\n",buffer_size,num_records_in_bucket*num_buckets_to_read*rounds);
-                }
-                // end of for loop rounds
-
-                if (DEBUG)
-                    printf("shuffling %llu buckets with %llu bytes each...\n", num_buckets_to_read * rounds, num_records_in_bucket * NONCE_SIZE);
-#pragma omp parallel for schedule(static)
-                for (unsigned long long s = 0; s < num_buckets_to_read; s++)
-                {
-                    for (unsigned long long r = 0; r < rounds; r++)
-                    {
-                        off_t index_src = ((r * num_buckets_to_read + s) * num_records_in_bucket);
-                        off_t index_dest = (s * rounds + r) * num_records_in_bucket;
-
-                        memcpy(&bufferShuffled[index_dest], &buffer[index_src], num_records_in_bucket * sizeof(MemoRecord));
-                    }
                 }
-                // end of for loop num_buckets_to_read
-
-                // should write in parallel if possible
-                size_t elementsWritten = fwrite(bufferShuffled, sizeof(MemoRecord), num_records_in_bucket * num_buckets_to_read * rounds, fd_dest);
-                if (elementsWritten != num_records_in_bucket * num_buckets_to_read * rounds)
+                for (int k = 0; k < NUM_STRIPES; k++)
                 {
-                    fprintf(stderr, "Error writing bucket to file; elements written %zu when expected %llu\n",
-                            elementsWritten, num_records_in_bucket * num_buckets_to_read * rounds);
-                    fclose(fd_dest);
-                    exit(EXIT_FAILURE);
+                    pthread_join(shufflers[k], NULL);
                 }
+            }
 
-                /*if (fsync(fileno(fd_dest)) != 0) {
-                    perror("Failed to fsync buffer");
-                    fclose(fd_dest);
-                    return EXIT_FAILURE;
-                }*/
-
-                double end_time_io2 = omp_get_wtime();
-                elapsed_time_io2 = end_time_io2 - start_time_io2;
-                elapsed_time_io2_total += elapsed_time_io2;
-                double throughput_io2 = (num_records_in_bucket * num_buckets_to_read * rounds * NONCE_SIZE) / (elapsed_time_io2 * 1024 * 1024);
-                if (!BENCHMARK)
-                    printf("[%.2f] Shuffle %.2f%%: %.2f MB/s\n", omp_get_wtime() - start_time, (i + 1) * 100.0 / num_buckets, throughput_io2);
+            // The stripes ran side by side, the slowest one is the shuffle's time
+            elapsed_time_io2 = 0.0;
+            for (int k = 0; k < NUM_STRIPES; k++)
+            {
+                elapsed_time_io2 = fmax(elapsed_time_io2, stripe_jobs[k].elapsed_time);
             }
-            // end of for loop
+            elapsed_time_io2_total += elapsed_time_io2;
             start_time_io = omp_get_wtime();
-
-            // Flush and close the file
-            if (writeData)
+        }
+        else if (writeDataFinal && rounds == 1)
+        {
+            for (int k = 0; k < NUM_STRIPES; k++)
             {
-                if (fflush(fd) != 0)
+                // Call the rename_file function
+                if (move_file_overwrite(temp_names[k], final_names[k]) == 0)
                 {
-                    perror("Failed to flush buffer");
-                    fclose(fd);
-                    return EXIT_FAILURE;
+                    if (!BENCHMARK)
+                        printf("File renamed/moved successfully from '%s' to '%s'.\n", temp_names[k], final_names[k]);
                 }
-
-                if (fsync(fileno(fd)) != 0)
+                else
                 {
-                    perror("Failed to fsync buffer");
-                    fclose(fd);
+                    printf("Error in moving file '%s' to '%s'.\n", temp_names[k], final_names[k]);
                     return EXIT_FAILURE;
+                    // Error message already printed by rename_file via perror()
+                    // Additional handling can be done here if necessary
+                    // return 1;
                 }
-                fclose(fd);
             }
+        }
 
-            if (writeDataFinal)
+        // Sort the finished stripes by hash in one more pass over them; an in-memory
+        // plot was sorted before it was written and only needs its footer
+        if (HASH_SORT && writeDataFinal)
+        {
+            double start_time_sort = omp_get_wtime();
+            for (int k = 0; k < NUM_STRIPES; k++)
             {
-                if (fflush(fd_dest) != 0)
+                if (in_memory)
                 {
-                    perror("Failed to flush buffer");
-                    fclose(fd_dest);
-                    return EXIT_FAILURE;
+                    // Described the way hash_sort_plot_file() reads an unflagged plot
+                    PlotLayout sorted_layout = {1, rounds * num_records_in_bucket, 1, PLOT_FLAG_HASH_SORTED};
+                    if (!write_plot_footer(final_names[k], &sorted_layout, stripe_buckets))
+                    {
+                        printf("Error writing plot footer to %s\n", final_names[k]);
+                        return EXIT_FAILURE;
+                    }
                 }
-
-                if (fsync(fileno(fd_dest)) != 0)
+                else if (!hash_sort_plot_file(final_names[k], stripe_buckets))
                 {
-                    perror("Failed to fsync buffer");
-                    fclose(fd_dest);
+                    printf("Error sorting %s by hash\n", final_names[k]);
                     return EXIT_FAILURE;
                 }
-
-                fclose(fd_dest);
-
-                remove_file(FILENAME);
-            }
-
-            free(buffer);
-        }
-        else if (writeDataFinal && rounds == 1)
-        {
-            // Call the rename_file function
-            if (move_file_overwrite(FILENAME, FILENAME_FINAL) == 0)
-            {
-                if (!BENCHMARK)
-                    printf("File renamed/moved successfully from '%s' to '%s'.\n", FILENAME, FILENAME_FINAL);
-            }
-            else
-            {
-                printf("Error in moving file '%s' to '%s'.\n", FILENAME, FILENAME_FINAL);
-                return EXIT_FAILURE;
-                // Error message already printed by rename_file via perror()
-                // Additional handling can be done here if necessary
-                // return 1;
             }
+            if (!BENCHMARK && !in_memory)
+                printf("[%.2f] Hash Sort: %.2f MB/s\n", omp_get_wtime() - start_time, file_size_bytes / ((omp_get_wtime() - start_time_sort) * 1024 * 1024));
         }
 
 // will need to check on MacOS with a spinning hdd if we need to call sync() to flush all filesystems
 #ifdef __linux__
         if (DEBUG)
             printf("Final flush in progress...\n");
-        int fd2 = open(FILENAME_FINAL, O_RDWR);
-        if (fd2 == -1)
+        for (int k = 0; k < NUM_STRIPES; k++)
         {
-            printf("Error opening file %s (#6)\n", FILENAME_FINAL);
+            int fd2 = open(final_names[k], O_RDWR);
+            if (fd2 == -1)
+            {
+                printf("Error opening file %s (#6)\n", final_names[k]);
 
-            perror("Error opening file");
-            return EXIT_FAILURE;
+                perror("Error opening file");
+                return EXIT_FAILURE;
+            }
+
+            // Only the plot's own data has to reach the device, not the rest of the file system
+            if (sync_file_data(fd2) == -1)
+            {
+                perror("Error syncing plot file");
+                close(fd2);
+                return EXIT_FAILURE;
+            }
+
+            // Every extent beyond the first is a potential seek for lookups
+            long extents = count_file_extents(fd2);
+            if (!BENCHMARK && extents >= 0)
+            {
+                printf("Final File Extents: %ld\n", extents);
+            }
+            if (PREALLOCATE == PREALLOCATE_CONTIGUOUS && extents > 1)
+            {
+                fprintf(stderr, "Warning: %s is stored in %ld extents, not one contiguous extent\n", final_names[k], extents);
+            }
+            close(fd2);
         }
+#endif
 
-        // Sync the entire filesystem
-        if (syncfs(fd2) == -1)
+        // The manifest is written last, once every stripe it lists is durable
+        if (NUM_STRIPES > 1 && writeDataFinal && !write_stripe_manifest(FILENAME_FINAL, final_names, NUM_STRIPES, stripe_buckets))
         {
-            perror("Error syncing filesystem with syncfs");
-            close(fd2);
             return EXIT_FAILURE;
         }
-#endif
 
         end_time_io = omp_get_wtime();
         elapsed_time_io = end_time_io - start_time_io;
@@ -1814,6 +5377,7 @@ int main(int argc, char *argv[])
         {
             printf("Total Throughput: %.2f MH/s  %.2f MB/s\n", total_throughput, total_throughput * NONCE_SIZE);
             printf("Total Time: %.6f seconds\n", elapsed_time);
+            printf("Peak RSS: %.2f MB\n", get_peak_rss_bytes() / (1024 * 1024.0));
         }
         else
         {